@@ -0,0 +1,230 @@
+/*
+	Serial output test: ALSA events go through write_event_to_serial_port()
+	and tx_flush() into a pipe standing for the serial port, and the bytes
+	coming out are checked against the MIDI they have to be.
+
+	- a mixed batch of notes, controllers (7 and 14 bit), pitch bend,
+	  program change and sysex, written as it is, byte for byte;
+	- a batch too large for the kernel buffer (see --txqueue), which goes
+	  through the transmit queues: every message comes out once and whole,
+	  in its order within its kind, and notes are not left behind controllers;
+	- a clock written after a 2 KB sysex, which must not wait for the sysex
+	  to be queued and comes out right away, in the middle of it.
+
+	To compile: gcc tests/serial-output.c -o serial-output -lasound -lpthread
+	It exits with 0 when all checks pass.
+*/
+
+#define main ttymidi_main
+#include "../ttymidi-sysex.c"
+#undef main
+
+int failures;
+int pipe_out;  // read end of the pipe standing for the serial port
+
+/* Read everything written to the pipe so far */
+int read_output(unsigned char *out, int size)
+{
+	int n, len = 0;
+
+	while (len < size && (n = read(pipe_out, out + len, size - len)) > 0)
+		len += n;
+	return len;
+}
+
+void check(const char *what, int ok)
+{
+	printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+	if (!ok)
+		failures++;
+}
+
+void event_note(snd_seq_event_t *ev, int type, int channel, int note, int velocity)
+{
+	snd_seq_ev_clear(ev);
+	ev->type = type;
+	ev->data.note.channel  = channel;
+	ev->data.note.note     = note;
+	ev->data.note.velocity = velocity;
+}
+
+void event_control(snd_seq_event_t *ev, int type, int channel, int param, int value)
+{
+	snd_seq_ev_clear(ev);
+	ev->type = type;
+	ev->data.control.channel = channel;
+	ev->data.control.param   = param;
+	ev->data.control.value   = value;
+}
+
+void event_sysex(snd_seq_event_t *ev, unsigned char *data, int len)
+{
+	snd_seq_ev_clear(ev);
+	snd_seq_ev_set_sysex(ev, len, data);
+}
+
+/* One batch as the ALSA thread writes it: every event mixed, nothing queued */
+void test_direct(void)
+{
+	static unsigned char sysex[] = { 0xF0, 0x41, 0x10, 0x16, 0x12, 0xF7 };
+	static const unsigned char expected[] = {
+		0x90, 0x3C, 0x64,
+		0xB0, 0x07, 0x64,
+		0xF0, 0x41, 0x10, 0x16, 0x12, 0xF7,
+		0xB1, 0x07, 0x24, 0x27, 0x34,  // 14 bit controller 7: MSB, then LSB on controller 39
+		0xB1, 0x28, 0x05,              // 40 and above are 7 bit
+		0xE2, 0x00, 0x40,
+		0xC3, 0x05,
+		0x80, 0x3C, 0x00,
+	};
+	unsigned char out[256];
+	snd_seq_event_t ev;
+	int len;
+
+	arguments.txqueue = 0;
+
+	event_note(&ev, SND_SEQ_EVENT_NOTEON, 0, 60, 100);           write_event_to_serial_port(&ev);
+	event_control(&ev, SND_SEQ_EVENT_CONTROLLER, 0, 7, 100);     write_event_to_serial_port(&ev);
+	event_sysex(&ev, sysex, sizeof(sysex));                      write_event_to_serial_port(&ev);
+	event_control(&ev, SND_SEQ_EVENT_CONTROL14, 1, 7, 0x1234);   write_event_to_serial_port(&ev);
+	event_control(&ev, SND_SEQ_EVENT_CONTROL14, 1, 40, 5);       write_event_to_serial_port(&ev);
+	event_control(&ev, SND_SEQ_EVENT_PITCHBEND, 2, 0, 0);        write_event_to_serial_port(&ev);
+	event_control(&ev, SND_SEQ_EVENT_PGMCHANGE, 3, 0, 5);        write_event_to_serial_port(&ev);
+	event_note(&ev, SND_SEQ_EVENT_NOTEOFF, 0, 60, 0);            write_event_to_serial_port(&ev);
+	tx_flush();
+
+	len = read_output(out, sizeof(out));
+	check("mixed batch written byte for byte", len == sizeof(expected) && memcmp(out, expected, len) == 0);
+	if (len != sizeof(expected) || memcmp(out, expected, len) != 0) {
+		print_bytes("  expected", expected, sizeof(expected));
+		print_bytes("  got     ", out, len);
+	}
+}
+
+/* A batch larger than the kernel buffer may take: it goes through the queues */
+void test_queued(void)
+{
+	static unsigned char sysex[2000], out[8192];
+	snd_seq_event_t ev;
+	int len, i, pos, controllers = 0, notes = 0, sysex_ok = 0, in_order = TRUE, unknown = 0;
+	int note_at = -1, last_cc_at = -1;
+
+	arguments.txqueue = 4;
+
+	sysex[0] = 0xF0;
+	for (i = 1; i < (int)sizeof(sysex) - 1; i++)
+		sysex[i] = i & 0x7F;
+	sysex[sizeof(sysex) - 1] = 0xF7;
+
+	for (i = 0; i < 100; i++) {
+		event_control(&ev, SND_SEQ_EVENT_CONTROLLER, 0, 1, i);
+		write_event_to_serial_port(&ev);
+	}
+	event_note(&ev, SND_SEQ_EVENT_NOTEON, 0, 60, 100);
+	write_event_to_serial_port(&ev);
+	event_sysex(&ev, sysex, sizeof(sysex));
+	write_event_to_serial_port(&ev);
+	event_note(&ev, SND_SEQ_EVENT_NOTEOFF, 0, 60, 0);
+	write_event_to_serial_port(&ev);
+	tx_flush();
+	while (tx_queued())
+		tx_pump();
+
+	/* split the output into messages again, there is no running status and no real time byte */
+	len = read_output(out, sizeof(out));
+	for (pos = 0; pos < len; ) {
+		if (out[pos] == 0xF0) {
+			sysex_ok += pos + (int)sizeof(sysex) <= len && memcmp(out + pos, sysex, sizeof(sysex)) == 0;
+			pos += sizeof(sysex);
+		} else if (out[pos] == 0xB0 && pos + 3 <= len && out[pos + 1] == 1) {
+			in_order &= out[pos + 2] == controllers;
+			controllers++;
+			last_cc_at = pos;
+			pos += 3;
+		} else if ((out[pos] & 0xE0) == 0x80 && pos + 3 <= len && out[pos + 1] == 60) {
+			in_order &= out[pos] == (notes == 0 ? 0x90 : 0x80);
+			if (notes++ == 0)
+				note_at = pos;
+			pos += 3;
+		} else {
+			unknown++;
+			pos++;
+		}
+	}
+
+	check("queued batch: 100 controllers once each, in order", controllers == 100 && in_order);
+	check("queued batch: note on and off once each, in order", notes == 2 && in_order);
+	check("queued batch: sysex once and whole", sysex_ok == 1);
+	check("queued batch: no stray bytes", unknown == 0 && len == 100 * 3 + 2 * 3 + (int)sizeof(sysex));
+	check("queued batch: note on not left behind the controllers", note_at >= 0 && note_at < last_cc_at);
+}
+
+/* Writing a sysex must not wait for it to drain: a clock read after it goes out before its F7 */
+void test_clock_in_sysex(void)
+{
+	static unsigned char sysex[2000], out[4096];
+	snd_seq_event_t ev;
+	int len, first, clock_at = -1, end_at = -1, clocks = 0, i;
+
+	arguments.txqueue = 4;
+
+	sysex[0] = 0xF0;
+	for (i = 1; i < (int)sizeof(sysex) - 1; i++)
+		sysex[i] = i & 0x7F;
+	sysex[sizeof(sysex) - 1] = 0xF7;
+
+	event_sysex(&ev, sysex, sizeof(sysex));
+	write_event_to_serial_port(&ev);
+	tx_flush();
+	first = read_output(out, sizeof(out));
+
+	snd_seq_ev_clear(&ev);
+	ev.type = SND_SEQ_EVENT_CLOCK;
+	write_event_to_serial_port(&ev);
+	tx_flush();
+	while (tx_queued())
+		tx_pump();
+	len = first + read_output(out + first, sizeof(out) - first);
+
+	for (i = 0; i < len; i++) {
+		if (out[i] == 0xF8) {
+			clock_at = i;
+			clocks++;
+		} else if (out[i] == 0xF7) {
+			end_at = i;
+		}
+	}
+
+	check("sysex: written without waiting for it to drain", first < (int)sizeof(sysex) / 4);
+	check("sysex: clock once, before the F7", clocks == 1 && clock_at >= 0 && clock_at < end_at);
+	check("sysex: clock right after what was written before it", clock_at >= 0 && clock_at <= first + 64);
+	check("sysex: whole around the clock", len == (int)sizeof(sysex) + 1 && end_at == len - 1);
+	if (clock_at >= 0 && len == (int)sizeof(sysex) + 1) {
+		memmove(out + clock_at, out + clock_at + 1, len - clock_at - 1);
+		check("sysex: bytes unchanged", memcmp(out, sysex, sizeof(sysex)) == 0);
+	}
+}
+
+int main(void)
+{
+	int fd[2];
+
+	arg_set_defaults(&arguments);
+	arguments.silent = TRUE;
+	run = TRUE;
+
+	if (pipe(fd) < 0) {
+		perror("pipe");
+		return 2;
+	}
+	serial = fd[1];
+	pipe_out = fd[0];
+	fcntl(pipe_out, F_SETFL, O_NONBLOCK);
+
+	test_direct();
+	test_queued();
+	test_clock_in_sysex();
+
+	printf("%s\n", failures ? "FAILED" : "passed");
+	return failures ? 1 : 0;
+}
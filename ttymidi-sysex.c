@@ -72,6 +72,7 @@
 */
 
 
+#define _GNU_SOURCE  // pthread_setaffinity_np()
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -83,6 +84,24 @@
 #include <alsa/asoundlib.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 // Linux-specific
 #include <linux/serial.h>
 #include <linux/ioctl.h>
@@ -92,36 +111,133 @@
 #define TRUE                1
 
 #define MAX_DEV_STR_LEN    32
+#define MAX_PATH_STR_LEN  108  // Maximum length of the serial device, room for a unix socket path
 #define MAX_MSG_SIZE     1024
 #define BUF_SIZE         1024  // Size of the serial midi buffer - determines the maximum size of sysex messages *new*
+#define MAX_CABLES         16  // Maximum number of virtual cables multiplexed over the serial link
+#define CABLE_SELECT     0xF5  // Undefined system common status, used as "F5 nn" cable select prefix
+#define TIMESTAMP        0xF4  // Undefined system common status, used as "F4 ll mm" device timestamp prefix
+#define SCHED_SIZE       1024  // Maximum number of ALSA events waiting for their time to be sent to serial
+#define RX_BUF_SIZE      4096  // Size of the serial receive ring, filled with one read() at a time (power of 2)
+#define RX_MIN_READ       256  // Room below which a sysex held in the receive ring is sent as a chunk
+#define TX_BUF_SIZE      4096  // Size of the serial transmit buffer a batch of events is encoded into
+#define TX_IOV_MAX         64  // Maximum number of buffers (encoded bytes and sysex payloads) in one write
+#define COBS_MAX_FRAME   1024  // Maximum size of an encoded COBS frame, delimiter excluded
+#define COBS_MAX_PAYLOAD  (COBS_MAX_FRAME - 1 - COBS_MAX_FRAME / 254 - 2)  // MIDI bytes per frame: COBS overhead and CRC-16 taken off
+#define UDP_MAX_PAYLOAD  1024  // MIDI bytes carried by one udp: datagram
+#define UDP_HISTORY        64  // udp: datagrams kept for resends, and held while one is missing (power of 2)
+#define UDP_RESEND_MS      20  // How long datagrams received after a missing one wait for its resend
+#define UDP_SYNC_MS        50  // Idle time after the last datagram sent before the sequence number is announced
+#define TX_QUEUE_SIZE   65536  // Size of each queue holding serial output until the kernel buffer has room (power of 2)
+#define TX_QUEUE_MIN       16  // Bytes the kernel buffer may always hold, whatever --txqueue and the baud rate
+#define TX_BACKLOG_MIN     64  // Bytes each transmit queue may always hold, whatever --backlog and the baud rate
+#define TX_RECORDS       1024  // Maximum number of messages waiting in each transmit queue
+#define TX_BULK_PATIENCE    4  // Writes sysex may wait behind channel messages before it goes first for one
+#define POOL_CLASSES        8  // Maximum number of sysex buffer size classes
+#define COALESCE_SIZE      64  // Maximum number of controller values held back at a time by --coalesce
+#define MAX_RATES          16  // Maximum number of --rate limits
+#define MAX_GAPS           16  // Maximum number of --sysex-gap rules
+#define RATE_BURST          2  // Messages a rate limited controller may send back to back after a pause
+#define SPIN_PAUSE_MAX     64  // Most pause hints between two empty polls with --read spin
+#define BENCH_PROBE_MS     50  // Interval between --benchmark probes
+#define BENCH_SAMPLES    4096  // Maximum number of probe round trip times kept for the --benchmark report
+#define BENCH_DECODE       -1  // arguments.benchmark for --benchmark decode
+#define BENCH_DECODE_SIZE 65536  // Size of the synthetic serial stream decoded by --benchmark decode
+
+#define FRAMING_RAW         0  // Plain MIDI byte stream on the serial link
+#define FRAMING_COBS        1  // COBS encoded frames carrying MIDI bytes + CRC-16, 0x00 delimited
+
+#define FLOW_NONE           0  // No flow control, the link has to be slow enough for both ends
+#define FLOW_RTSCTS         1  // RTS/CTS hardware handshaking
+#define FLOW_XONXOFF        2  // XON/XOFF (11/13 hex) software handshaking
+
+#define READ_BYTE           0  // Blocking reads that return as soon as one byte is there (VMIN 1, VTIME 0)
+#define READ_BATCH          1  // Blocking reads that wait for VMIN bytes, or VTIME after the first one
+#define READ_POLL           2  // poll() for input, then read what the driver has until it is empty
+#define READ_SPIN           3  // Busy poll serial and ALSA without ever sleeping
 
 /* change this definition for the correct port */
 //#define _POSIX_SOURCE 1 /* POSIX compliant source */
 
 int run;
 int serial;
-int port_out_id;
+int port_out_ids[MAX_CABLES];
+int port_in_ids[MAX_CABLES];
+int queue_id = -1;
 
 /* --------------------------------------------------------------------- */
 // Program options
 
 static struct argp_option options[] =
 {
-	{"serialdevice" , 's', "DEV" , 0, "Serial device to use. Default = /dev/ttyUSB0" },
+	{"serialdevice" , 's', "DEV" , 0, "Serial device to use, or a socket: unix:PATH or tcp:HOST:PORT to connect, unix-listen:PATH or tcp-listen:[HOST:]PORT to wait for a connection, udp:HOST:PORT or udp-listen:[HOST:]PORT for sequenced datagrams with resends. Default = /dev/ttyUSB0" },
 	{"baudrate"     , 'b', "BAUD", 0, "Serial port baud rate. Default = 115200" },
 	{"verbose"      , 'v', 0     , 0, "For debugging: Produce verbose output" },
 	{"printonly"    , 'p', 0     , 0, "Super debugging: Print values read from serial -- and do nothing else" },
 	{"quiet"        , 'q', 0     , 0, "Don't produce any output, even when the print command is sent" },
 	{"name"		, 'n', "NAME", 0, "Name of the Alsa MIDI client. Default = ttymidi" },
+	{"cables"       , 'c', "N"   , 0, "Number of virtual cables multiplexed over the serial link with F5 nn cable select prefixes (1-16). Default = 1" },
+	{"framing"      , 'f', "MODE", 0, "Serial link framing: raw, or cobs for COBS frames protected by a CRC-16. Default = raw" },
+	{"latency"      , 'l', "MS"  , 0, "Schedule messages carrying F4 ll mm device timestamps at this fixed latency. Default = 0 (timestamps not used)" },
+	{"coalesce"     , 'C', 0     , 0, "Under overload, only forward the latest pending value of each controller, pitch bend and aftertouch" },
+	{"rate"         , 'r', "SPEC", 0, "Maximum message rates, as KIND[/CHANNEL]=HZ limits separated by commas. KIND is ccN, cc (each controller), bend, pressure or polypressure (each key). The last value is always sent. Default = none" },
+	{"flow-control" , 'F', "MODE", 0, "Serial flow control: none, rtscts, or xonxoff when there are no handshake lines (the device must not send 11 or 13 hex otherwise). Default = none" },
+	{"sysex-gap"    , 'g', "SPEC", 0, "Gaps slow devices need between sysex messages, as [ID[.MODEL]:]MS[+US] rules separated by commas: MS milliseconds plus US microseconds per byte of the sysex, for a manufacturer ID (hex, 1 or 3 bytes) and model byte, or for all. Other messages go on during gaps. Default = none" },
+	{"txqueue"      , 't', "MS"  , 0, "Milliseconds of output (at the baud rate) allowed in the kernel serial buffer, the rest waits in ttymidi. 0 = no limit. Default = 4" },
+	{"backlog"      , 'k', "MS"  , 0, "Milliseconds of output (at the baud rate) the real time, note and controller classes may each queue in ttymidi. Beyond that ALSA input waits, so --coalesce and --rate act on it. Sysex may queue 32 KiB. 0 = up to 64 KiB. Default = 20" },
+	{"pool"         , 'P', "SPEC", 0, "Sysex buffers preallocated at startup, as SIZE:COUNT size classes separated by commas. Default = 64:64,256:32,1024:16,4096:8" },
+	{"read"         , 'R', "MODE", 0, "Serial read strategy: byte (wake up for every byte, lowest latency), batch[:VMIN[:VTIME]] (wake up after VMIN bytes, or VTIME tenths of a second after the first one, default 32:1), poll (poll, then drain the driver), or spin (busy poll serial and ALSA, keeping up to two cores busy, see --cpu). Default = byte" },
+	{"rawmidi"      , 'm', "DEV" , 0, "Bridge the serial port to this ALSA rawmidi device (e.g. hw:1,0 of snd-virmidi) instead of sequencer ports. Bytes pass unchanged both ways, so --cables, --latency, --coalesce and --rate do not apply. Default = none (sequencer ports)" },
+	{"passthrough"  , 'T', 0     , 0, "Forward serial input to the sequencer ports with ALSA's MIDI byte encoder instead of the ttymidi parser, and sequencer events to serial without scheduling. --cables, --latency, --coalesce and --rate do not apply" },
+	{"cpu"          , 'A', "CPU[,CPU]", 0, "Pin the serial reader thread to a CPU core, and the ALSA reader thread to a second one if given. Default = not pinned" },
+	{"benchmark"    , 'B', "SECS|decode", 0, "Run for SECS seconds sending a probe sysex every 50 ms, then report CPU usage, serial reads and the round trip time of the probes coming back (the serial TX has to be looped back to RX, or the device has to echo). With decode instead, decode a synthetic serial stream for a second without opening any device, and report events/s. Default = 0 (off)" },
 	{ 0 }
 };
 
+typedef struct _rate_spec
+{
+	char text[24];  // as given on the command line
+	int  type;      // alsa event type
+	int  param;     // controller number, -1 for each controller (or key) on its own
+	int  channel;   // 0-15, -1 for each channel on its own
+	int  hz;
+} rate_spec_t;
+
+typedef struct _gap_spec
+{
+	int  id;           // manufacturer ID, 3 byte IDs as 0x10000 | 2nd << 8 | 3rd, -1 for all
+	int  model;        // model byte following the device ID, -1 for all
+	int  ms;           // fixed gap after the sysex
+	int  us_per_byte;  // added for each byte of the sysex
+} gap_spec_t;
+
 typedef struct _arguments
 {
 	int  silent, verbose, printonly;
-	char serialdevice[MAX_DEV_STR_LEN];
+	char serialdevice[MAX_PATH_STR_LEN];
 	int  baudrate;
+	int  baudrate_bps;  // baudrate in bits per second
 	char name[MAX_DEV_STR_LEN];
+	char rawmidi[MAX_DEV_STR_LEN];  // rawmidi device name, empty for sequencer ports
+	int  passthrough;
+	int  cables;
+	int  framing;
+	int  flow_control;
+	int  read_mode;
+	int  read_vmin, read_vtime;  // termios VMIN and VTIME with --read batch
+	int  cpu_serial, cpu_alsa;  // cores the reader threads are pinned to, -1 when not pinned
+	int  benchmark;
+	int  latency;
+	int  txqueue;
+	int  backlog;
+	int  gap_count;
+	gap_spec_t gap[MAX_GAPS];
+	int  coalesce;
+	int  rate_count;
+	rate_spec_t rate[MAX_RATES];
+	int  pool_classes;
+	int  pool_size[POOL_CLASSES];
+	int  pool_count[POOL_CLASSES];
 } arguments_t;
 
 void exit_cli(int sig)
@@ -130,12 +246,78 @@ void exit_cli(int sig)
 	printf("\nttymidi closing down...");
 }
 
+/* Parse one KIND[/CHANNEL]=HZ rate limit, ended by a comma or the end of the string */
+int parse_rate(const char *spec, rate_spec_t *rate)
+{
+	char kind[16];
+	int n, len = strcspn(spec, ",");
+
+	snprintf(rate->text, sizeof(rate->text), "%.*s", len, spec);
+	rate->param   = -1;
+	rate->channel = -1;
+
+	if (sscanf(spec, "%15[a-z]%n", kind, &n) != 1) return FALSE;
+	spec += n;
+	if      (strcmp(kind, "cc") == 0)           rate->type = SND_SEQ_EVENT_CONTROLLER;
+	else if (strcmp(kind, "bend") == 0)         rate->type = SND_SEQ_EVENT_PITCHBEND;
+	else if (strcmp(kind, "pressure") == 0)     rate->type = SND_SEQ_EVENT_CHANPRESS;
+	else if (strcmp(kind, "polypressure") == 0) rate->type = SND_SEQ_EVENT_KEYPRESS;
+	else return FALSE;
+
+	if (rate->type == SND_SEQ_EVENT_CONTROLLER && *spec >= '0' && *spec <= '9') {
+		rate->param = strtol(spec, (char **)&spec, 10);
+		if (rate->param > 127) return FALSE;
+	}
+	if (*spec == '/') {
+		rate->channel = strtol(spec + 1, (char **)&spec, 10) - 1;
+		if (rate->channel < 0 || rate->channel > 15) return FALSE;
+	}
+	if (*spec != '=') return FALSE;
+	rate->hz = strtol(spec + 1, (char **)&spec, 10);
+	return rate->hz >= 1 && rate->hz <= 100000 && (*spec == ',' || *spec == '\0');
+}
+
+/* Parse one [ID[.MODEL]:]MS[+US] sysex gap, ended by a comma or the end of the string */
+int parse_gap(const char *spec, gap_spec_t *gap)
+{
+	char *end;
+
+	gap->id          = -1;
+	gap->model       = -1;
+	gap->us_per_byte = 0;
+
+	if (strcspn(spec, ":,") < strcspn(spec, ",")) {
+		gap->id = strtol(spec, &end, 16);
+		if (end - spec == 6 && spec[0] == '0' && spec[1] == '0')
+			gap->id |= 0x10000;
+		else if (end - spec != 2 || gap->id < 1 || gap->id > 0x7F)
+			return FALSE;
+		if (*end == '.') {
+			spec = end + 1;
+			gap->model = strtol(spec, &end, 16);
+			if (end == spec || gap->model > 0x7F) return FALSE;
+		}
+		if (*end != ':') return FALSE;
+		spec = end + 1;
+	}
+
+	gap->ms = strtol(spec, &end, 10);
+	if (end == spec || gap->ms < 0 || gap->ms > 10000) return FALSE;
+	if (*end == '+') {
+		spec = end + 1;
+		gap->us_per_byte = strtol(spec, &end, 10);
+		if (end == spec || gap->us_per_byte < 0 || gap->us_per_byte > 10000) return FALSE;
+	}
+	return *end == ',' || *end == '\0';
+}
+
 static error_t parse_opt (int key, char *arg, struct argp_state *state)
 {
 	/* Get the input argument from argp_parse, which we
 	   know is a pointer to our arguments structure. */
 	arguments_t *arguments = state->input;
-	int baud_temp;
+	int baud_temp, cables_temp;
+	char *spec;
 
 	switch (key)
 	{
@@ -148,14 +330,161 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 		case 'v':
 			arguments->verbose = 1;
 			break;
+		case 'C':
+			arguments->coalesce = 1;
+			break;
 		case 's':
 			if (arg == NULL) break;
-			strncpy(arguments->serialdevice, arg, MAX_DEV_STR_LEN);
+			strncpy(arguments->serialdevice, arg, MAX_PATH_STR_LEN);
 			break;
 		case 'n':
 			if (arg == NULL) break;
 			strncpy(arguments->name, arg, MAX_DEV_STR_LEN);
 			break;
+		case 'c':
+			if (arg == NULL) break;
+			cables_temp = strtol(arg, NULL, 0);
+			if (cables_temp < 1 || cables_temp > MAX_CABLES) {
+				printf("Number of cables %i is not supported (1-%i).\n", cables_temp, MAX_CABLES);
+				exit(1);
+			}
+			arguments->cables = cables_temp;
+			break;
+		case 'l':
+			if (arg == NULL) break;
+			arguments->latency = strtol(arg, NULL, 0);
+			if (arguments->latency < 0 || arguments->latency > 10000) {
+				printf("Latency %i ms is not supported (0-10000).\n", arguments->latency);
+				exit(1);
+			}
+			break;
+		case 'r':
+			if (arg == NULL) break;
+			for (spec = arg; spec != NULL; spec = strchr(spec, ',') ? strchr(spec, ',') + 1 : NULL) {
+				if (arguments->rate_count == MAX_RATES || !parse_rate(spec, &arguments->rate[arguments->rate_count])) {
+					printf("Rate %s is not supported (up to %i KIND[/CHANNEL]=HZ limits).\n", arg, MAX_RATES);
+					exit(1);
+				}
+				arguments->rate_count++;
+			}
+			break;
+		case 'g':
+			if (arg == NULL) break;
+			for (spec = arg; spec != NULL; spec = strchr(spec, ',') ? strchr(spec, ',') + 1 : NULL) {
+				if (arguments->gap_count == MAX_GAPS || !parse_gap(spec, &arguments->gap[arguments->gap_count])) {
+					printf("Sysex gap %s is not supported (up to %i [ID[.MODEL]:]MS[+US] rules).\n", arg, MAX_GAPS);
+					exit(1);
+				}
+				arguments->gap_count++;
+			}
+			break;
+		case 't':
+			if (arg == NULL) break;
+			arguments->txqueue = strtol(arg, NULL, 0);
+			if (arguments->txqueue < 0 || arguments->txqueue > 1000) {
+				printf("Transmit queue %i ms is not supported (0-1000).\n", arguments->txqueue);
+				exit(1);
+			}
+			break;
+		case 'k':
+			if (arg == NULL) break;
+			arguments->backlog = strtol(arg, NULL, 0);
+			if (arguments->backlog < 0 || arguments->backlog > 10000) {
+				printf("Backlog %i ms is not supported (0-10000).\n", arguments->backlog);
+				exit(1);
+			}
+			break;
+		case 'P':
+			if (arg == NULL) break;
+			arguments->pool_classes = 0;
+			for (spec = arg; *spec != '\0'; spec++) {
+				int size, count, n = arguments->pool_classes;
+				if (n == POOL_CLASSES || sscanf(spec, "%i:%i", &size, &count) != 2 ||
+				    size < (int)sizeof(void *) || count < 0 ||
+				    (n > 0 && size <= arguments->pool_size[n - 1])) {
+					printf("Sysex pool %s is not supported (up to %i SIZE:COUNT classes, sizes increasing).\n", arg, POOL_CLASSES);
+					exit(1);
+				}
+				arguments->pool_size[n]  = size;
+				arguments->pool_count[n] = count;
+				arguments->pool_classes++;
+				if ((spec = strchr(spec, ',')) == NULL) break;
+			}
+			break;
+		case 'f':
+			if (arg == NULL) break;
+			if (strcmp(arg, "raw") == 0) {
+				arguments->framing = FRAMING_RAW;
+			} else if (strcmp(arg, "cobs") == 0) {
+				arguments->framing = FRAMING_COBS;
+			} else {
+				printf("Framing %s is not supported.\n", arg);
+				exit(1);
+			}
+			break;
+		case 'F':
+			if (arg == NULL) break;
+			if (strcmp(arg, "none") == 0) {
+				arguments->flow_control = FLOW_NONE;
+			} else if (strcmp(arg, "rtscts") == 0) {
+				arguments->flow_control = FLOW_RTSCTS;
+			} else if (strcmp(arg, "xonxoff") == 0) {
+				arguments->flow_control = FLOW_XONXOFF;
+			} else {
+				printf("Flow control %s is not supported.\n", arg);
+				exit(1);
+			}
+			break;
+		case 'R':
+			if (arg == NULL) break;
+			if (strcmp(arg, "byte") == 0) {
+				arguments->read_mode = READ_BYTE;
+			} else if (strcmp(arg, "poll") == 0) {
+				arguments->read_mode = READ_POLL;
+			} else if (strcmp(arg, "spin") == 0) {
+				arguments->read_mode = READ_SPIN;
+			} else if (strncmp(arg, "batch", 5) == 0 && (arg[5] == '\0' || arg[5] == ':')) {
+				arguments->read_mode = READ_BATCH;
+				if (arg[5] == ':')
+					sscanf(arg + 6, "%i:%i", &arguments->read_vmin, &arguments->read_vtime);
+				if (arguments->read_vmin < 1 || arguments->read_vmin > 255 ||
+				    arguments->read_vtime < 0 || arguments->read_vtime > 255) {
+					printf("Read batch %s is not supported (VMIN 1-255, VTIME 0-255).\n", arg + 5);
+					exit(1);
+				}
+			} else {
+				printf("Read strategy %s is not supported.\n", arg);
+				exit(1);
+			}
+			break;
+		case 'T':
+			arguments->passthrough = 1;
+			break;
+		case 'm':
+			if (arg == NULL) break;
+			strncpy(arguments->rawmidi, arg, MAX_DEV_STR_LEN - 1);
+			break;
+		case 'A':
+			if (arg == NULL) break;
+			if (sscanf(arg, "%i,%i", &arguments->cpu_serial, &arguments->cpu_alsa) < 1 ||
+			    arguments->cpu_serial < 0 || arguments->cpu_serial >= CPU_SETSIZE ||
+			    arguments->cpu_alsa < -1 || arguments->cpu_alsa >= CPU_SETSIZE) {
+				printf("CPU %s is not supported.\n", arg);
+				exit(1);
+			}
+			break;
+		case 'B':
+			if (arg == NULL) break;
+			if (strcmp(arg, "decode") == 0) {
+				arguments->benchmark = BENCH_DECODE;
+				break;
+			}
+			arguments->benchmark = strtol(arg, NULL, 0);
+			if (arguments->benchmark < 0) {
+				printf("Benchmark time %i s is not supported.\n", arguments->benchmark);
+				exit(1);
+			}
+			break;
 		case 'b':
 			if (arg == NULL) break;
 			baud_temp = strtol(arg, NULL, 0);
@@ -170,8 +499,16 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 					case 38400  : arguments->baudrate = B38400 ; break;
 					case 57600  : arguments->baudrate = B57600 ; break;
 					case 115200 : arguments->baudrate = B115200; break;
+					case 230400 : arguments->baudrate = B230400; break;
+					case 460800 : arguments->baudrate = B460800; break;
+					case 500000 : arguments->baudrate = B500000; break;
+					case 921600 : arguments->baudrate = B921600; break;
+					case 1000000: arguments->baudrate = B1000000; break;
+					case 1500000: arguments->baudrate = B1500000; break;
+					case 2000000: arguments->baudrate = B2000000; break;
 					default: printf("Baud rate %i is not supported.\n",baud_temp); exit(1);
 				}
+			arguments->baudrate_bps = baud_temp;
 
 		case ARGP_KEY_ARG:
 		case ARGP_KEY_END:
@@ -191,8 +528,31 @@ void arg_set_defaults(arguments_t *arguments)
 	arguments->silent       = 0;
 	arguments->verbose      = 0;
 	arguments->baudrate     = B115200;
+	arguments->baudrate_bps = 115200;
+	arguments->rawmidi[0]   = '\0';
+	arguments->passthrough  = 0;
+	arguments->cables       = 1;
+	arguments->framing      = FRAMING_RAW;
+	arguments->flow_control = FLOW_NONE;
+	arguments->read_mode    = READ_BYTE;
+	arguments->read_vmin    = 32;
+	arguments->read_vtime   = 1;
+	arguments->cpu_serial   = -1;
+	arguments->cpu_alsa     = -1;
+	arguments->benchmark    = 0;
+	arguments->latency      = 0;
+	arguments->txqueue      = 4;
+	arguments->backlog      = 20;
+	arguments->gap_count    = 0;
+	arguments->coalesce     = 0;
+	arguments->rate_count   = 0;
+	arguments->pool_classes = 4;
+	arguments->pool_size[0] =   64; arguments->pool_count[0] = 64;
+	arguments->pool_size[1] =  256; arguments->pool_count[1] = 32;
+	arguments->pool_size[2] = 1024; arguments->pool_count[2] = 16;
+	arguments->pool_size[3] = 4096; arguments->pool_count[3] =  8;
 	char *name_tmp		= (char *)"ttymidi";
-	strncpy(arguments->serialdevice, serialdevice_temp, MAX_DEV_STR_LEN);
+	strncpy(arguments->serialdevice, serialdevice_temp, MAX_PATH_STR_LEN);
 	strncpy(arguments->name, name_tmp, MAX_DEV_STR_LEN);
 }
 
@@ -204,318 +564,2691 @@ arguments_t arguments;
 
 
 /* --------------------------------------------------------------------- */
-// MIDI stuff
+// Timing
+
+/*
+	With --latency, the device can prefix any message with F4 ll mm, a 14-bit
+	millisecond timestamp (ll = 7 LSBs, mm = 7 MSBs) taken from a free running
+	device clock. Like any system common message, F4 cancels running status.
+
+	Device time is mapped to host time through the smallest transport delay seen
+	so far, which leaks upwards slowly to follow clock drift between both ends.
+	Messages are then scheduled on an ALSA queue at their mapped time plus the
+	latency, which turns USB burst jitter into a constant delay.
+
+	All other messages carry the time of the serial read they were completed by,
+	as a real time stamp of the same queue. That time is already past, so they
+	are delivered at once, but recorders see timing as close as possible to the wire.
+*/
+
+#define NSEC_PER_MSEC        1000000LL
+#define NSEC_PER_SEC      1000000000LL
+#define DEVICE_CLOCK_WRAP        16384  // device timestamps are 14-bit milliseconds
+#define DEVICE_CLOCK_LEAK        10000  // transport delay estimate grows by 1/10000 of elapsed time (100 ppm)
+#define DEVICE_CLOCK_RESYNC  NSEC_PER_SEC  // delays that much above the estimate mean the device clock jumped
+
+long long queue_start_ns;  // CLOCK_MONOTONIC time at which the ALSA queue real time was 0
+
+long long device_time_ns;     // unwrapped time of the last device timestamp
+int       device_time_last;   // last raw 14-bit timestamp, -1 before the first one
+long long device_delay_ns;    // estimated minimum transport delay, host time - device time
+long long device_delay_seen;  // host time at which device_delay_ns was last updated
+
+long long monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void open_queue(snd_seq_t* seq)
+{
+	snd_seq_queue_status_t *status;
+	const snd_seq_real_time_t *rt;
+
+	if ((queue_id = snd_seq_alloc_named_queue(seq, arguments.name)) < 0)
+	{
+		fprintf(stderr, "Error creating sequencer queue.\n");
+		queue_id = -1;
+		return;
+	}
+	snd_seq_start_queue(seq, queue_id, NULL);
+	snd_seq_drain_output(seq);
+
+	/* the queue timer runs from the system clock, so one sample pins it to CLOCK_MONOTONIC */
+	snd_seq_queue_status_alloca(&status);
+	snd_seq_get_queue_status(seq, queue_id, status);
+	rt = snd_seq_queue_status_get_real_time(status);
+	queue_start_ns = monotonic_ns() - (rt->tv_sec * NSEC_PER_SEC + rt->tv_nsec);
+	device_time_last = -1;
+}
+
+/* Host time at which a message carrying the 14-bit device timestamp stamp should be delivered */
+long long device_time_to_host(int stamp, long long now_ns)
+{
+	long long delay;
+
+	if (device_time_last < 0)
+		device_time_ns = stamp * NSEC_PER_MSEC;
+	else
+		device_time_ns += ((stamp - device_time_last + DEVICE_CLOCK_WRAP) % DEVICE_CLOCK_WRAP) * NSEC_PER_MSEC;
+	device_time_last = stamp;
+
+	delay = now_ns - device_time_ns;
+	if (device_delay_seen != 0)
+		device_delay_ns += (now_ns - device_delay_seen) / DEVICE_CLOCK_LEAK;
+	if (device_delay_seen == 0 || delay < device_delay_ns || delay > device_delay_ns + DEVICE_CLOCK_RESYNC)
+		device_delay_ns = delay;
+	device_delay_seen = now_ns;
+
+	return device_time_ns + device_delay_ns + arguments.latency * NSEC_PER_MSEC;
+}
+
+void set_event_time(snd_seq_event_t *ev, long long due_ns)
+{
+	snd_seq_real_time_t rt;
+
+	if (queue_id < 0 || due_ns <= 0)
+	{
+		snd_seq_ev_set_direct(ev);
+		return;
+	}
+	due_ns -= queue_start_ns;
+	if (due_ns < 0) due_ns = 0;
+	rt.tv_sec  = due_ns / NSEC_PER_SEC;
+	rt.tv_nsec = due_ns % NSEC_PER_SEC;
+	snd_seq_ev_schedule_real(ev, queue_id, 0, &rt);
+}
+
+
+/* --------------------------------------------------------------------- */
+// Sysex buffers
+
+/*
+	Sysex data that has to outlive the ALSA event it came with is copied into
+	buffers from a pool allocated once at startup, so the MIDI path itself never
+	calls malloc() or free(). Each size class is a contiguous run of equally
+	sized blocks with a free list threaded through the unused ones, and a
+	request takes the smallest class with a free block that fits.
+
+	When no block fits, pool_alloc() returns NULL and counts a miss: the caller
+	falls back to handling the message at once. The high water marks printed
+	at exit show how to size --pool for a deployment.
+
+	The pool is only used from the ALSA thread and needs no locking.
+*/
+
+typedef struct _pool_class
+{
+	int size, count;
+	unsigned char *base;  // first block, blocks are contiguous
+	void *free_list;      // unused blocks, each one starts with a pointer to the next
+	int used, high_water;
+} pool_class_t;
+
+pool_class_t pool[POOL_CLASSES];
+int pool_classes;
+unsigned long pool_misses;
+
+void open_pool(void)
+{
+	unsigned char *block = NULL;
+	size_t total = 0;
+	int i, j;
+
+	/* block sizes are rounded up to a multiple of the pointer size, keeping the free list pointers aligned */
+	for (i = 0; i < arguments.pool_classes; i++) {
+		arguments.pool_size[i] = (arguments.pool_size[i] + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+		total += (size_t)arguments.pool_size[i] * arguments.pool_count[i];
+	}
+	if (total > 0 && (block = malloc(total)) == NULL)
+	{
+		fprintf(stderr, "Error allocating %zu bytes of sysex buffers.\n", total);
+		exit(1);
+	}
+
+	pool_classes = arguments.pool_classes;
+	for (i = 0; i < pool_classes; i++) {
+		pool[i].size  = arguments.pool_size[i];
+		pool[i].count = arguments.pool_count[i];
+		pool[i].base  = block;
+		pool[i].free_list = NULL;
+		for (j = pool[i].count - 1; j >= 0; j--) {
+			*(void **)(block + (size_t)j * pool[i].size) = pool[i].free_list;
+			pool[i].free_list = block + (size_t)j * pool[i].size;
+		}
+		block += (size_t)pool[i].size * pool[i].count;
+	}
+}
+
+void* pool_alloc(int len)
+{
+	void *block;
+	int i;
+
+	for (i = 0; i < pool_classes; i++) {
+		if (pool[i].size < len || pool[i].free_list == NULL)
+			continue;
+		block = pool[i].free_list;
+		pool[i].free_list = *(void **)block;
+		if (++pool[i].used > pool[i].high_water)
+			pool[i].high_water = pool[i].used;
+		return block;
+	}
+	pool_misses++;
+	return NULL;
+}
+
+void pool_free(void *ptr)
+{
+	unsigned char *block = ptr;
+	int i;
+
+	for (i = 0; i < pool_classes; i++) {
+		if (block < pool[i].base || block >= pool[i].base + (size_t)pool[i].size * pool[i].count)
+			continue;
+		*(void **)block = pool[i].free_list;
+		pool[i].free_list = block;
+		pool[i].used--;
+		return;
+	}
+}
+
+
+/* --------------------------------------------------------------------- */
+// Serial link
+
+/*
+	With --framing cobs, both directions carry COBS encoded frames terminated by 0x00.
+	Each decoded frame holds MIDI bytes followed by a CRC-16/CCITT (poly 0x1021,
+	init 0xFFFF) of those bytes, MSB first. Frames with a bad CRC or a bad COBS
+	encoding are counted and dropped, and the parser restarts at the next frame,
+	so the device should start every frame on a message boundary. A frame is at
+	most COBS_MAX_FRAME bytes encoded, which leaves COBS_MAX_PAYLOAD MIDI bytes;
+	longer frames are dropped as too long, and longer sysex is sent over several.
+*/
+
+long long rx_time_ns;  // CLOCK_MONOTONIC time of the last serial read that returned data
+unsigned long rx_reads, rx_bytes;  // read() calls that returned data, and the bytes they returned
+
+int serial_is_socket, serial_is_tcp, serial_is_udp;  // what the serial device names, see open_socket_link()
+
+/*
+	Received MIDI bytes go to the rx_buf ring. rx_head and rx_tail are free
+	running counters (position = counter & RX_MASK): bytes rx_head .. rx_tail-1
+	are waiting to be parsed. While a sysex is being received, its bytes from
+	rx_hold on stay in the ring until they are handed to ALSA, so rx_fill()
+	only reads into the space that is neither pending nor held.
+*/
+
+#define RX_MASK  (RX_BUF_SIZE - 1)
+
+unsigned char rx_buf[RX_BUF_SIZE];
+unsigned int rx_head, rx_tail;
+unsigned int rx_hold;  // start of the held sysex bytes, when rx_holding
+int rx_holding;
+
+unsigned char rx_frame[COBS_MAX_FRAME];  // encoded COBS frame being received
+int rx_frame_len;
+int rx_frame_overflow;
+
+unsigned long rx_frames_ok, rx_frames_bad_crc, rx_frames_bad_cobs, rx_frames_too_long;
+unsigned long rx_frames_dropped;  // sum of the error counters above, watched by the parser
+
+unsigned short crc16_ccitt(const unsigned char *data, int len)
+{
+	unsigned short crc = 0xFFFF;
+	int i, bit;
+
+	for (i = 0; i < len; i++) {
+		crc ^= (unsigned short)data[i] << 8;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+/* Decode a COBS frame (delimiter excluded) into out, returns the decoded length or -1 */
+int cobs_decode(const unsigned char *in, int len, unsigned char *out)
+{
+	int i = 0, o = 0, code, j;
+
+	while (i < len) {
+		code = in[i++];
+		if (code == 0x00 || i + code - 1 > len)
+			return -1;
+		for (j = 1; j < code; j++)
+			out[o++] = in[i++];
+		if (code < 0xFF && i < len)
+			out[o++] = 0x00;
+	}
+	return o;
+}
+
+/* Encode len bytes into out (at least len + len/254 + 1 bytes), returns the encoded length */
+int cobs_encode(const unsigned char *in, int len, unsigned char *out)
+{
+	int i, o = 1, code_pos = 0;
+	unsigned char code = 0x01;
+
+	for (i = 0; i < len; i++) {
+		if (in[i] == 0x00) {
+			out[code_pos] = code;
+			code_pos = o++;
+			code = 0x01;
+		} else {
+			out[o++] = in[i];
+			if (++code == 0xFF) {
+				out[code_pos] = code;
+				code_pos = o++;
+				code = 0x01;
+			}
+		}
+	}
+	out[code_pos] = code;
+	return o;
+}
+
+/* A complete encoded frame is in rx_frame: validate it and append its MIDI bytes to rx_buf */
+void rx_frame_complete(void)
+{
+	unsigned char decoded[COBS_MAX_FRAME];
+	int len, i;
+	unsigned short crc;
+
+	if (rx_frame_overflow) {
+		rx_frames_too_long++;
+	} else if (rx_frame_len == 0) {
+		return;  // back to back delimiters, used by devices to flush the line
+	} else if ((len = cobs_decode(rx_frame, rx_frame_len, decoded)) < 2) {
+		rx_frames_bad_cobs++;
+	} else if (len - 2 > COBS_MAX_PAYLOAD) {
+		rx_frames_too_long++;
+	} else {
+		crc = (decoded[len - 2] << 8) | decoded[len - 1];
+		if (crc != crc16_ccitt(decoded, len - 2)) {
+			rx_frames_bad_crc++;
+		} else {
+			for (i = 0; i < len - 2; i++)
+				rx_buf[rx_tail++ & RX_MASK] = decoded[i];
+			rx_frames_ok++;
+			rx_frame_len = 0;
+			return;
+		}
+	}
+
+	rx_frames_dropped++;
+	if (!arguments.silent && arguments.verbose) {
+		printf("Serial  -- Dropped frame len = %04X\n", rx_frame_len);
+		fflush(stdout);
+	}
+	rx_frame_len = 0;
+	rx_frame_overflow = FALSE;
+}
+
+/* Free bytes of the ring, neither pending nor held, less what one decoded frame or datagram may add at once */
+int rx_free(void)
+{
+	int room = RX_BUF_SIZE - (rx_tail - (rx_holding ? rx_hold : rx_head));
+
+	if (serial_is_udp)
+		return room - UDP_MAX_PAYLOAD;
+	if (arguments.framing == FRAMING_RAW)
+		return room;
+	return room - COBS_MAX_FRAME;
+}
+
+/* Number of bytes rx_fill() can read without touching pending or held bytes */
+int rx_room(void)
+{
+	int room = rx_free();
+	int contiguous = RX_BUF_SIZE - (rx_tail & RX_MASK);
+
+	/* raw reads go straight into the ring and stop at its end, decoded frames and datagrams are copied with wrap-around */
+	if (arguments.framing == FRAMING_RAW && !serial_is_udp && contiguous < room)
+		return contiguous;
+	return room;
+}
+
+/* Wait for serial input until the CLOCK_MONOTONIC deadline, returns FALSE on timeout */
+int serial_wait(long long deadline_ns)
+{
+	struct pollfd pfd = { serial, POLLIN, 0 };
+	long long timeout = (deadline_ns - monotonic_ns() + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+
+	return poll(&pfd, 1, timeout < 0 ? 0 : timeout) != 0;
+}
+
+/*
+	udp:HOST:PORT and udp-listen:[HOST:]PORT carry the serial byte stream in
+	datagrams, for MIDI between machines without a cable. Each one starts with
+	4D, its type, a 16-bit sequence number and the 16-bit session of the
+	sender, MSB first:
+	  4D 01 ss ss ee ee MIDI bytes   data, up to UDP_MAX_PAYLOAD bytes of the stream
+	  4D 02 ss ss ee ee nn           NAK: please resend the nn data datagrams of session ee from ss on
+	  4D 03 ss ss ee ee              sync: the next data datagram will be ss
+	The session is drawn at startup: a peer that restarts counts from 0 again
+	in a new session, which the receiver starts over at instead of taking its
+	datagrams for duplicates.
+	Everything tx_flush() writes at once goes into one datagram when it fits.
+	The sender keeps its last UDP_HISTORY data datagrams for resends. The
+	receiver hands data to the parser in sequence order: it sends a NAK for
+	the numbers it skipped and holds what came after them for up to
+	UDP_RESEND_MS, then goes on without the missing ones. A sync follows
+	UDP_SYNC_MS after the last data, so a lost last datagram (typically a note
+	off) is noticed too. Datagrams go to whoever sent the last one, udp: sends
+	a sync when it starts so the listening side learns where it is.
+*/
+
+#define UDP_HEADER  6
+#define UDP_MAGIC   0x4D
+#define UDP_DATA    0x01
+#define UDP_NAK     0x02
+#define UDP_SYNC    0x03
+#define UDP_MASK    (UDP_HISTORY - 1)
+
+pthread_mutex_t udp_lock = PTHREAD_MUTEX_INITIALIZER;  // peer and sender state, used by both threads
+struct sockaddr_storage udp_peer;
+socklen_t udp_peer_len;  // 0 while the peer is not known
+unsigned char udp_history[UDP_HISTORY][UDP_HEADER + UDP_MAX_PAYLOAD];
+int udp_history_len[UDP_HISTORY];
+unsigned short udp_tx_seq;  // sequence number of the next data datagram
+unsigned short udp_tx_session;
+long long udp_sync_ns;      // when the ALSA thread sends a sync, 0 when none is due
+
+unsigned char udp_held[UDP_HISTORY][UDP_MAX_PAYLOAD];  // data received after a missing datagram
+int udp_held_len[UDP_HISTORY];  // 0 when the slot is empty
+unsigned short udp_rx_next;     // sequence number of the next data for the parser
+unsigned short udp_rx_seen;     // one past the highest sequence number seen
+unsigned short udp_rx_session;  // session of the peer, when udp_rx_synced
+int udp_rx_synced;
+long long udp_gap_ns;  // how long to wait for missing datagrams, 0 when none is missing
+
+unsigned long udp_sent, udp_resent, udp_received, udp_recovered, udp_lost, udp_duplicates, udp_bad;
+
+/* Send a datagram to the peer, dropped while it is not known; udp_lock is held */
+void udp_send_datagram(const unsigned char *data, int len)
+{
+	if (udp_peer_len > 0)
+		sendto(serial, data, len, 0, (struct sockaddr *)&udp_peer, udp_peer_len);
+}
+
+void udp_send_sync(void)
+{
+	unsigned char msg[UDP_HEADER] = { UDP_MAGIC, UDP_SYNC };
+
+	pthread_mutex_lock(&udp_lock);
+	msg[2] = udp_tx_seq >> 8;
+	msg[3] = udp_tx_seq & 0xFF;
+	msg[4] = udp_tx_session >> 8;
+	msg[5] = udp_tx_session & 0xFF;
+	udp_send_datagram(msg, UDP_HEADER);
+	udp_sync_ns = 0;
+	pthread_mutex_unlock(&udp_lock);
+}
+
+void udp_send_nak(unsigned short seq, int count)
+{
+	unsigned char msg[UDP_HEADER + 1] = { UDP_MAGIC, UDP_NAK, seq >> 8, seq & 0xFF,
+	                                      udp_rx_session >> 8, udp_rx_session & 0xFF, count };
+
+	pthread_mutex_lock(&udp_lock);
+	udp_send_datagram(msg, UDP_HEADER + 1);
+	pthread_mutex_unlock(&udp_lock);
+}
+
+/* Number and send the data datagram built in the history slot of udp_tx_seq; udp_lock is held */
+void udp_send_data(int len)
+{
+	udp_history_len[udp_tx_seq & UDP_MASK] = len;
+	udp_send_datagram(udp_history[udp_tx_seq & UDP_MASK], len);
+	udp_tx_seq++;
+	udp_sent++;
+}
+
+/* Serial output over udp: pack the bytes into as few data datagrams as they fit in */
+void udp_send(const struct iovec *iov, int iovcnt)
+{
+	unsigned char *dgram = NULL;
+	size_t off, n;
+	int len = 0, i;
+
+	pthread_mutex_lock(&udp_lock);
+	if (udp_peer_len == 0) {
+		pthread_mutex_unlock(&udp_lock);
+		return;  // nobody to send to yet
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		for (off = 0; off < iov[i].iov_len; off += n) {
+			if (dgram == NULL) {
+				dgram = udp_history[udp_tx_seq & UDP_MASK];
+				dgram[0] = UDP_MAGIC;
+				dgram[1] = UDP_DATA;
+				dgram[2] = udp_tx_seq >> 8;
+				dgram[3] = udp_tx_seq & 0xFF;
+				dgram[4] = udp_tx_session >> 8;
+				dgram[5] = udp_tx_session & 0xFF;
+				len = UDP_HEADER;
+			}
+			n = iov[i].iov_len - off;
+			if (n > (size_t)(UDP_HEADER + UDP_MAX_PAYLOAD - len))
+				n = UDP_HEADER + UDP_MAX_PAYLOAD - len;
+			memcpy(dgram + len, (unsigned char *)iov[i].iov_base + off, n);
+			len += n;
+			if (len == UDP_HEADER + UDP_MAX_PAYLOAD) {
+				udp_send_data(len);
+				dgram = NULL;
+			}
+		}
+	}
+	if (dgram != NULL)
+		udp_send_data(len);
+
+	udp_sync_ns = monotonic_ns() + UDP_SYNC_MS * NSEC_PER_MSEC;
+	pthread_mutex_unlock(&udp_lock);
+}
+
+/* A NAK came: resend the datagrams asked for that are still in the history */
+void udp_resend(unsigned short seq, int count)
+{
+	unsigned short age;
+
+	pthread_mutex_lock(&udp_lock);
+	for (; count > 0; count--, seq++) {
+		age = udp_tx_seq - seq;
+		if (age == 0 || age > UDP_HISTORY)
+			continue;  // not sent yet, or overwritten since
+		udp_send_datagram(udp_history[seq & UDP_MASK], udp_history_len[seq & UDP_MASK]);
+		udp_resent++;
+	}
+	pthread_mutex_unlock(&udp_lock);
+}
+
+/* Append the MIDI bytes of the next data datagram to rx_buf, the caller checked the room */
+void udp_deliver(const unsigned char *data, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		rx_buf[rx_tail++ & RX_MASK] = data[i];
+	udp_rx_next++;
+}
+
+/* Hand held datagrams that are next in sequence to rx_buf while there is room, returns the bytes added */
+int udp_deliver_held(void)
+{
+	int slot, total = 0;
+
+	while (udp_rx_next != udp_rx_seen && udp_held_len[slot = udp_rx_next & UDP_MASK] > 0 &&
+	       rx_room() + UDP_MAX_PAYLOAD >= udp_held_len[slot]) {
+		total += udp_held_len[slot];
+		udp_deliver(udp_held[slot], udp_held_len[slot]);
+		udp_held_len[slot] = 0;
+	}
+
+	/* a datagram is still missing: its resend has until the deadline */
+	if (udp_rx_next == udp_rx_seen)
+		udp_gap_ns = 0;
+	else if (udp_gap_ns == 0 && udp_held_len[udp_rx_next & UDP_MASK] == 0)
+		udp_gap_ns = monotonic_ns() + UDP_RESEND_MS * NSEC_PER_MSEC;
+	return total;
+}
+
+/* The missing datagrams were not resent in time: go on with the ones held after them */
+void udp_skip_gap(void)
+{
+	while (udp_rx_next != udp_rx_seen && udp_held_len[udp_rx_next & UDP_MASK] == 0) {
+		udp_rx_next++;
+		udp_lost++;
+	}
+	udp_gap_ns = 0;
+
+	if (!arguments.silent && arguments.verbose) {
+		printf("Serial  -- Datagrams lost, going on at %04X\n", udp_rx_next);
+		fflush(stdout);
+	}
+}
+
+/* Wait for a datagram and take it in, data next in sequence goes to rx_buf */
+void udp_receive(void)
+{
+	unsigned char dgram[UDP_HEADER + UDP_MAX_PAYLOAD];
+	struct sockaddr_storage from;
+	socklen_t from_len = sizeof(from);
+	unsigned short seq, session;
+	int n, skipped, ahead, slot;
+
+	if (udp_gap_ns != 0 && !serial_wait(udp_gap_ns)) {
+		udp_skip_gap();
+		return;
+	}
+
+	n = recvfrom(serial, dgram, sizeof(dgram), 0, (struct sockaddr *)&from, &from_len);
+	if (n < 0)
+		return;
+	if (n < UDP_HEADER || dgram[0] != UDP_MAGIC || (dgram[1] == UDP_DATA && n == UDP_HEADER)) {
+		udp_bad++;
+		return;
+	}
+	rx_time_ns = monotonic_ns();
+	rx_reads++;
+	rx_bytes += n;
+
+	/* answer whoever sent the last datagram */
+	pthread_mutex_lock(&udp_lock);
+	memcpy(&udp_peer, &from, from_len);
+	udp_peer_len = from_len;
+	pthread_mutex_unlock(&udp_lock);
+
+	seq = (dgram[2] << 8) | dgram[3];
+	session = (dgram[4] << 8) | dgram[5];
+	if (dgram[1] == UDP_NAK) {
+		if (n > UDP_HEADER && session == udp_tx_session)  // not one asking for what we sent before a restart
+			udp_resend(seq, dgram[UDP_HEADER]);
+		return;
+	}
+	if (dgram[1] != UDP_DATA && dgram[1] != UDP_SYNC) {
+		udp_bad++;
+		return;
+	}
+
+	/* the first datagram, one of a new session (the peer restarted) or one too far from where we are: start over at it */
+	ahead = (short)(seq - udp_rx_next);
+	if (!udp_rx_synced || session != udp_rx_session || ahead < -UDP_HISTORY || ahead >= UDP_HISTORY) {
+		memset(udp_held_len, 0, sizeof(udp_held_len));
+		udp_rx_next = udp_rx_seen = seq;
+		udp_rx_session = session;
+		udp_rx_synced = TRUE;
+		udp_gap_ns = 0;
+		ahead = 0;
+	}
+
+	/* sequence numbers skipped since the highest one seen: ask for them once */
+	skipped = (short)(seq - udp_rx_seen);
+	if (skipped > 0) {
+		udp_send_nak(udp_rx_seen, skipped);
+		if (udp_gap_ns == 0)
+			udp_gap_ns = rx_time_ns + UDP_RESEND_MS * NSEC_PER_MSEC;
+		udp_rx_seen = seq;
+	}
+	if (dgram[1] == UDP_SYNC)
+		return;
+
+	slot = seq & UDP_MASK;
+	if (ahead < 0 || udp_held_len[slot] > 0) {
+		udp_duplicates++;
+		return;
+	}
+	udp_received++;
+	if (skipped < 0)
+		udp_recovered++;  // a resend, or one that came out of order
+	else
+		udp_rx_seen = seq + 1;
+
+	if (ahead == 0) {
+		udp_deliver(dgram + UDP_HEADER, n - UDP_HEADER);
+		udp_deliver_held();
+	} else {
+		memcpy(udp_held[slot], dgram + UDP_HEADER, n - UDP_HEADER);
+		udp_held_len[slot] = n - UDP_HEADER;
+	}
+}
+
+/*
+	The serial device can also be a socket, so software devices (emulators,
+	test rigs, boards behind socat) need no pty in between: unix:PATH and
+	tcp:HOST:PORT connect, unix-listen:PATH and tcp-listen:[HOST:]PORT wait for
+	a connection, and for the next one whenever it closes. The socket carries
+	the same byte stream as the serial port, without the tty settings.
+*/
+
+int link_listen_fd = -1;
+unsigned long link_connections;  // connections accepted after the first one, watched by the parser and tx_flush()
+
+/* Set up a connected socket for the link, returns it */
+int link_connected(int fd)
+{
+	int one = 1;
+
+	if (serial_is_tcp)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	/* poll and spin read until there is nothing left, which needs non-blocking reads */
+	if (arguments.read_mode == READ_POLL || arguments.read_mode == READ_SPIN)
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+int link_accept(void)
+{
+	int fd;
+
+	if (!arguments.silent) {
+		printf("Waiting for a connection on %s\n", arguments.serialdevice);
+		fflush(stdout);
+	}
+	while ((fd = accept(link_listen_fd, NULL, NULL)) < 0) {
+		if (errno != EINTR) {
+			perror(arguments.serialdevice);
+			exit(-1);
+		}
+	}
+	return link_connected(fd);
+}
+
+/* Open the socket the serial device names, returns -1 when it names a device */
+int open_socket_link(const char *spec)
+{
+	struct sockaddr_un addr;
+	struct addrinfo hints, *res, *ai;
+	char host[MAX_PATH_STR_LEN], *name, *port;
+	int fd = -1, listening, one = 1, err;
+
+	if (strncmp(spec, "unix:", 5) == 0 || strncmp(spec, "unix-listen:", 12) == 0) {
+		listening = spec[4] == '-';
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, spec + (listening ? 12 : 5), sizeof(addr.sun_path) - 1);
+		if (listening)
+			unlink(addr.sun_path);  // left over from an earlier run
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
+		    (listening ? bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0
+		               : connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)) {
+			close(fd);
+			fd = -1;
+		}
+	} else if (strncmp(spec, "tcp:", 4) == 0 || strncmp(spec, "tcp-listen:", 11) == 0 ||
+	           strncmp(spec, "udp:", 4) == 0 || strncmp(spec, "udp-listen:", 11) == 0) {
+		listening = spec[3] == '-';
+		serial_is_udp = spec[0] == 'u';
+		serial_is_tcp = !serial_is_udp;
+		udp_tx_session = getpid() ^ monotonic_ns() / 1000;  // differs from the one before a restart
+		if (serial_is_udp && arguments.framing != FRAMING_RAW) {
+			fprintf(stderr, "udp datagrams are already framed and checked, use --framing raw.\n");
+			exit(1);
+		}
+		strncpy(host, spec + (listening ? 11 : 4), sizeof(host) - 1);
+		host[sizeof(host) - 1] = '\0';
+
+		/* HOST:PORT, [IPV6]:PORT, or PORT alone to listen on all addresses */
+		if ((port = strrchr(host, ':')) != NULL) {
+			*port++ = '\0';
+			name = host;
+			if (name[0] == '[' && name[strlen(name) - 1] == ']') {
+				name[strlen(name) - 1] = '\0';
+				name++;
+			}
+		} else {
+			port = host;
+			name = NULL;
+		}
+		if (name != NULL && name[0] == '\0')
+			name = NULL;
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = serial_is_udp ? SOCK_DGRAM : SOCK_STREAM;
+		hints.ai_flags = listening ? AI_PASSIVE : 0;
+		if ((err = getaddrinfo(name, port, &hints, &res)) != 0) {
+			fprintf(stderr, "%s: %s\n", spec, gai_strerror(err));
+			exit(-1);
+		}
+		for (ai = res; ai != NULL; ai = ai->ai_next) {
+			if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+				continue;
+			if (listening)
+				setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (serial_is_udp && !listening) {
+				memcpy(&udp_peer, ai->ai_addr, ai->ai_addrlen);  // datagrams are sent with sendto()
+				udp_peer_len = ai->ai_addrlen;
+				break;
+			}
+			if (listening ? bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && (serial_is_udp || listen(fd, 1) == 0)
+			              : connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(res);
+	} else {
+		return -1;
+	}
+
+	if (fd < 0) {
+		perror(spec);
+		exit(-1);
+	}
+	serial_is_socket = TRUE;
+	if (serial_is_udp) {
+		serial = fd;
+		if (!listening)
+			udp_send_sync();  // tells the listening side where we are
+		return fd;
+	}
+	if (!listening)
+		return link_connected(fd);
+	link_listen_fd = fd;
+	return link_accept();
+}
+
+/* The peer closed the socket: wait for the next connection when listening, stop otherwise */
+void link_closed(void)
+{
+	int fd;
+
+	if (!arguments.silent) {
+		printf("Serial  -- Connection closed\n");
+		fflush(stdout);
+	}
+	if (link_listen_fd < 0) {
+		run = FALSE;
+		pthread_exit(NULL);
+	}
+	fd = link_accept();
+	dup2(fd, serial);  // same descriptor number, the ALSA thread goes on writing to it
+	close(fd);
+
+	/* nothing received from the old peer carries over to the new one */
+	rx_holding = FALSE;
+	rx_frame_len = 0;
+	rx_frame_overflow = FALSE;
+	link_connections++;
+}
+
+/*
+	How serial input is read is set by --read. byte and batch are blocking reads
+	with the termios VMIN/VTIME set in main(): byte returns on the first byte,
+	batch trades up to VTIME of latency for fewer wakeups during bursts. poll
+	(VMIN 0, VTIME 0) waits in poll() and then reads until the driver is empty,
+	which takes all of a burst that arrived meanwhile without any added delay.
+	spin (VMIN 0, VTIME 0 too) never sleeps: it retries the read with pause hints
+	in between, doubling up to SPIN_PAUSE_MAX while nothing arrives and then
+	yielding, so the wakeup latency of the scheduler is gone at the cost of a
+	busy core. It is meant for cores set aside for it (isolcpus, --cpu).
+*/
+
+const char *read_mode_names[] = { "byte", "batch", "poll", "spin" };
+
+/* Tell the CPU we are busy waiting (lets the sibling hyperthread run, saves power) */
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ __volatile__("pause");
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/* Back off after an empty busy poll, *pauses starts at 1 and is reset by the caller when work arrives */
+void spin_pause(int *pauses)
+{
+	int i;
+
+	for (i = 0; i < *pauses; i++)
+		cpu_relax();
+	if (*pauses < SPIN_PAUSE_MAX)
+		*pauses *= 2;
+	else
+		sched_yield();  // free on a dedicated core, lets other threads run on a shared one
+}
+
+/* Read up to len bytes of serial input, returns the number of bytes read, 0 when none arrived */
+int serial_read(unsigned char *data, int len)
+{
+	struct pollfd pfd = { serial, POLLIN, 0 };
+	int n = -1, total = 0, pauses = 1;
+
+	/* a read returning 0 on a socket is the end of the connection, on a tty it only means no data */
+	if (arguments.read_mode == READ_SPIN) {
+		while ((n = read(serial, data, len)) <= 0) {
+			if (n == 0 && serial_is_socket)
+				link_closed();
+			spin_pause(&pauses);
+		}
+		total = n;
+		rx_reads++;
+	} else if (arguments.read_mode == READ_POLL) {
+		if (poll(&pfd, 1, 100) <= 0)
+			return 0;
+		while (total < len && (n = read(serial, data + total, len - total)) > 0) {
+			total += n;
+			rx_reads++;
+		}
+		if (n == 0 && total == 0 && serial_is_socket)
+			link_closed();
+	} else if ((n = read(serial, data, len)) > 0) {
+		total = n;
+		rx_reads++;
+	} else if (n == 0 && serial_is_socket) {
+		link_closed();
+	}
+
+	if (total > 0)
+		rx_time_ns = monotonic_ns();
+	rx_bytes += total;
+	return total;
+}
+
+/* Block until some MIDI bytes are available in rx_buf, the caller makes sure rx_room() > 0 */
+void rx_fill(void)
+{
+	unsigned char raw[RX_BUF_SIZE - COBS_MAX_FRAME];
+	int n, i;
+
+	if (!rx_holding)
+		rx_head = rx_tail = 0;  // whole ring free, start over for the largest contiguous read
+
+	while (rx_head == rx_tail) {
+		if (serial_is_udp) {
+			if (udp_deliver_held() == 0)
+				udp_receive();
+			continue;
+		}
+
+		if (arguments.framing == FRAMING_RAW) {
+			rx_tail += serial_read(rx_buf + (rx_tail & RX_MASK), rx_room());
+			continue;
+		}
+
+		/* decoded bytes never outnumber encoded ones, so the frames completed here fit in the room */
+		n = serial_read(raw, rx_room());
+		for (i = 0; i < n; i++) {
+			if (raw[i] == 0x00) {
+				rx_frame_complete();
+			} else if (rx_frame_len < COBS_MAX_FRAME) {
+				rx_frame[rx_frame_len++] = raw[i];
+			} else {
+				rx_frame_overflow = TRUE;
+			}
+		}
+	}
+}
+
+unsigned char serial_read_byte(void)
+{
+	if (rx_head == rx_tail)
+		rx_fill();
+	return rx_buf[rx_head++ & RX_MASK];
+}
+
+void serial_read_bytes(unsigned char *data, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		data[i] = serial_read_byte();
+}
+
+/*
+	Most bytes of a big sysex dump are 7-bit data bytes. Instead of running them
+	one at a time through the parser, find_status_byte() looks for the next byte
+	with the high bit set in the receive buffer, 16 or 32 bytes per step, and the
+	whole data run is skipped at once. The widest implementation supported by the
+	CPU is picked at startup.
+*/
+
+size_t find_status_byte_scalar(const unsigned char *data, size_t len)
+{
+	size_t i = 0;
+	uint64_t word;
+
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&word, data + i, 8);
+		if (word & 0x8080808080808080ULL)
+			break;
+	}
+	while (i < len && !(data[i] & 0x80))
+		i++;
+	return i;
+}
+
+#if defined(__SSE2__)
+size_t find_status_byte_sse2(const unsigned char *data, size_t len)
+{
+	size_t i = 0;
+	int mask;
+
+	for (; i + 16 <= len; i += 16) {
+		mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(data + i)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + find_status_byte_scalar(data + i, len - i);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+size_t find_status_byte_avx2(const unsigned char *data, size_t len)
+{
+	size_t i = 0;
+	unsigned int mask;
+
+	for (; i + 32 <= len; i += 32) {
+		mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(data + i)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + find_status_byte_scalar(data + i, len - i);
+}
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+size_t find_status_byte_neon(const unsigned char *data, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		if (vmaxvq_u8(vld1q_u8(data + i)) & 0x80)
+			break;
+	}
+	return i + find_status_byte_scalar(data + i, len - i);
+}
+#endif
+
+size_t (*find_status_byte)(const unsigned char *data, size_t len) = find_status_byte_scalar;
+
+void select_status_scanner(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		find_status_byte = find_status_byte_avx2;
+		return;
+	}
+#endif
+#if defined(__SSE2__)
+	find_status_byte = find_status_byte_sse2;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	find_status_byte = find_status_byte_neon;
+#endif
+}
+
+/* Skip the data bytes already received up to the next status byte or the end of the ring, returns their count */
+int serial_skip_data_run(void)
+{
+	unsigned int pos = rx_head & RX_MASK;
+	unsigned int avail = rx_tail - rx_head;
+	int n;
+
+	n = find_status_byte(rx_buf + pos, avail < RX_BUF_SIZE - pos ? avail : RX_BUF_SIZE - pos);
+	rx_head += n;
+	return n;
+}
+
+unsigned long long tx_written;  // bytes handed to the kernel so far
+
+/* Write the whole iovec list, going on after partial writes and waiting for room on EAGAIN */
+void serial_writev_all(struct iovec *iov, int iovcnt)
+{
+	struct pollfd pfd = { serial, POLLOUT, 0 };
+	ssize_t n;
+
+	if (serial_is_udp) {
+		udp_send(iov, iovcnt);
+		return;
+	}
+
+	while (iovcnt > 0) {
+		n = writev(serial, iov, iovcnt);
+		if (n > 0)
+			tx_written += n;
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				poll(&pfd, 1, 100);
+			else if (errno != EINTR)
+				return;
+			if (!run) return;
+			continue;
+		}
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (unsigned char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+/*
+	Time output is held back by flow control is estimated from the kernel
+	buffer: between two samples that both found bytes waiting, whatever did
+	not drain at the baud rate was held back.
+*/
+
+long long tx_blocked_ns;  // output held back, estimated
+long long tx_sample_ns;   // time of the last kernel buffer sample
+int tx_sample_outq;
+unsigned long long tx_sample_written;
+unsigned long tx_samples;
+
+void tx_sample_flow(int outq)
+{
+	long long now_ns = monotonic_ns();
+	long long drained = tx_sample_outq + (long long)(tx_written - tx_sample_written) - outq;
+	long long held_ns = now_ns - tx_sample_ns - drained * NSEC_PER_SEC * 10 / arguments.baudrate_bps;
+
+	if (tx_sample_outq > 0 && outq > 0 && held_ns > 0)
+		tx_blocked_ns += held_ns;
+	tx_sample_ns = now_ns;
+	tx_sample_outq = outq;
+	tx_sample_written = tx_written;
+	tx_samples++;
+}
+
+/* Number of bytes the kernel buffer may take now with --txqueue, *outq is what it already holds */
+int tx_kernel_room(int *outq)
+{
+	int limit = (long long)arguments.txqueue * arguments.baudrate_bps / 10 / 1000;
+
+	if (ioctl(serial, TIOCOUTQ, outq) < 0)
+		*outq = 0;
+	if (arguments.flow_control != FLOW_NONE)
+		tx_sample_flow(*outq);
+	if (limit < TX_QUEUE_MIN)
+		limit = TX_QUEUE_MIN;
+	return *outq < limit ? limit - *outq : 0;
+}
+
+/* Append one COBS frame carrying len bytes of payload (CRC added here) to out, returns its size */
+int cobs_frame(const unsigned char *payload, int len, unsigned char *out)
+{
+	unsigned char data[COBS_MAX_PAYLOAD + 2];
+	unsigned short crc;
+	int frame_len;
+
+	memcpy(data, payload, len);
+	crc = crc16_ccitt(payload, len);
+	data[len]     = crc >> 8;
+	data[len + 1] = crc & 0xFF;
+	frame_len = cobs_encode(data, len + 2, out);
+	out[frame_len++] = 0x00;
+	return frame_len;
+}
+
+#define COBS_FRAME_LEN(len)  ((len) + 2 + ((len) + 2) / 254 + 2)
+
+/* Write a list of buffers with a single syscall when possible */
+void serial_writev(struct iovec *iov, int iovcnt)
+{
+	unsigned char payload[COBS_MAX_PAYLOAD];
+	static unsigned char frames[2 * TX_BUF_SIZE];
+	struct iovec out;
+	int payload_len = 0, frames_len = 0, i;
+	size_t j;
+
+	if (arguments.framing == FRAMING_RAW) {
+		serial_writev_all(iov, iovcnt);
+		return;
+	}
+
+	/* frames hold up to COBS_MAX_PAYLOAD bytes, so they encode to COBS_MAX_FRAME at most, and are written out together */
+	for (i = 0; i < iovcnt; i++) {
+		for (j = 0; j < iov[i].iov_len; j++) {
+			payload[payload_len++] = ((unsigned char *)iov[i].iov_base)[j];
+			if (payload_len == COBS_MAX_PAYLOAD || (i == iovcnt - 1 && j == iov[i].iov_len - 1)) {
+				if (frames_len + COBS_FRAME_LEN(payload_len) > sizeof(frames)) {
+					out.iov_base = frames; out.iov_len = frames_len;
+					serial_writev_all(&out, 1);
+					frames_len = 0;
+				}
+				frames_len += cobs_frame(payload, payload_len, frames + frames_len);
+				payload_len = 0;
+			}
+		}
+	}
+	out.iov_base = frames; out.iov_len = frames_len;
+	serial_writev_all(&out, 1);
+}
+
+void serial_write(const unsigned char *data, int len)
+{
+	struct iovec iov = { (void *)data, len };
+
+	serial_writev(&iov, 1);
+}
+
+
+/* --------------------------------------------------------------------- */
+// MIDI stuff
+
+void open_seq(snd_seq_t** seq)
+{
+	char port_name[MAX_DEV_STR_LEN];
+	int cable;
+
+	if (snd_seq_open(seq, "default", SND_SEQ_OPEN_DUPLEX, 0) < 0)
+	{
+		fprintf(stderr, "Error opening ALSA sequencer.\n");
+		exit(1);
+	}
+
+	snd_seq_set_client_name(*seq, arguments.name);
+
+	/* one port pair per virtual cable, keeping the historical names when there is only one */
+	for (cable = 0; cable < arguments.cables; cable++)
+	{
+		if (arguments.cables > 1)
+			snprintf(port_name, MAX_DEV_STR_LEN, "MIDI out %i", cable + 1);
+		else
+			snprintf(port_name, MAX_DEV_STR_LEN, "MIDI out");
+
+		if ((port_out_ids[cable] = snd_seq_create_simple_port(*seq, port_name,
+						SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ,
+						SND_SEQ_PORT_TYPE_MIDI_GENERIC|SND_SEQ_PORT_TYPE_APPLICATION)) < 0)  // *new*
+		{
+			fprintf(stderr, "Error creating sequencer %s port.\n", port_name);
+		}
+
+		if (arguments.cables > 1)
+			snprintf(port_name, MAX_DEV_STR_LEN, "MIDI in %i", cable + 1);
+		else
+			snprintf(port_name, MAX_DEV_STR_LEN, "MIDI in");
+
+		if ((port_in_ids[cable] = snd_seq_create_simple_port(*seq, port_name,
+						SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE,
+						SND_SEQ_PORT_TYPE_MIDI_GENERIC|SND_SEQ_PORT_TYPE_APPLICATION)) < 0)  // *new*
+		{
+			fprintf(stderr, "Error creating sequencer %s port.\n", port_name);
+		}
+	}
+}
+
+int cable_of_port(int port)
+{
+	int cable;
+
+	for (cable = 0; cable < arguments.cables; cable++)
+		if (port_in_ids[cable] == port)
+			return cable;
+	return 0;
+}
+
+/*
+	MIDI COMMANDS
+	-------------------------------------------------------------------
+	name                 status      param 1          param 2
+	-------------------------------------------------------------------
+	note off             0x80+C       key #            velocity
+	note on              0x90+C       key #            velocity
+	poly key pressure    0xA0+C       key #            pressure value
+	control change       0xB0+C       control #        control value
+	program change       0xC0+C       program #        --
+	mono key pressure    0xD0+C       pressure value   --
+	pitch bend           0xE0+C       range (LSB)      range (MSB)
+	system               0xF0+C       manufacturer     model
+	-------------------------------------------------------------------
+	C is the channel number, from 0 to 15;
+	-------------------------------------------------------------------
+	source: http://ftp.ec.vanderbilt.edu/computermusic/musc216site/MIDI.Commands.html
+
+	Every status byte has an entry in midi_status[]: the message length with the
+	status byte (0 for sysex), the ALSA event type, and how the data bytes map
+	to the event. System real time messages are one byte long and may show up
+	anywhere, even inside another message, without disturbing it.
+
+	0xFF is not handled as a system reset: FF 00 00 starts a text comment from
+	the device (see read_midi_from_serial_port).
+*/
+
+#define STATUS_DATA_NONE      0  // no data bytes, or not a MIDI event
+#define STATUS_DATA_NOTE      1  // data.note.note, data.note.velocity
+#define STATUS_DATA_CONTROL   2  // data.control.param, data.control.value
+#define STATUS_DATA_VALUE     3  // data.control.value = param1
+#define STATUS_DATA_VALUE14   4  // data.control.value = 14-bit param1 + param2
+#define STATUS_DATA_BEND      5  // same, centered on 0 (alsa pitch bend is signed)
+
+#define STATUS_CHANNEL     0x10  // channel voice message, channel in the low nibble
+#define STATUS_COMMON      0x20  // system common message, cancels running status
+#define STATUS_REALTIME    0x40  // system real time message
+#define STATUS_EXTENSION   0x80  // ttymidi extension (F4 timestamp, F5 cable select, FF text)
+
+typedef struct _midi_status
+{
+	unsigned char length;  // message length including the status byte, 0 for sysex
+	unsigned char type;    // alsa event type, SND_SEQ_EVENT_NONE when not forwarded as an event
+	unsigned char flags;   // STATUS_DATA_xxx | STATUS_xxx
+	const char   *name;
+} midi_status_t;
+
+#define CHANNEL_STATUS(first, len, ev_type, data, nm) \
+	[first ... first + 0x0F] = { len, ev_type, STATUS_CHANNEL | data, nm }
+
+const midi_status_t midi_status[256] =
+{
+	[0x00 ... 0x7F] = { 0, SND_SEQ_EVENT_NONE, STATUS_DATA_NONE, "Data" },
+	CHANNEL_STATUS(0x80, 3, SND_SEQ_EVENT_NOTEOFF   , STATUS_DATA_NOTE   , "Note off"),
+	CHANNEL_STATUS(0x90, 3, SND_SEQ_EVENT_NOTEON    , STATUS_DATA_NOTE   , "Note on"),
+	CHANNEL_STATUS(0xA0, 3, SND_SEQ_EVENT_KEYPRESS  , STATUS_DATA_NOTE   , "Pressure change"),
+	CHANNEL_STATUS(0xB0, 3, SND_SEQ_EVENT_CONTROLLER, STATUS_DATA_CONTROL, "Controller change"),
+	CHANNEL_STATUS(0xC0, 2, SND_SEQ_EVENT_PGMCHANGE , STATUS_DATA_VALUE  , "Program change"),
+	CHANNEL_STATUS(0xD0, 2, SND_SEQ_EVENT_CHANPRESS , STATUS_DATA_VALUE  , "Channel press"),
+	CHANNEL_STATUS(0xE0, 3, SND_SEQ_EVENT_PITCHBEND , STATUS_DATA_BEND   , "Pitch bend"),
+	[0xF0] = { 0, SND_SEQ_EVENT_SYSEX       , STATUS_DATA_NONE                      , "Sysex" },
+	[0xF1] = { 2, SND_SEQ_EVENT_QFRAME      , STATUS_COMMON | STATUS_DATA_VALUE     , "Quarter frame" },
+	[0xF2] = { 3, SND_SEQ_EVENT_SONGPOS     , STATUS_COMMON | STATUS_DATA_VALUE14   , "Song position" },
+	[0xF3] = { 2, SND_SEQ_EVENT_SONGSEL     , STATUS_COMMON | STATUS_DATA_VALUE     , "Song select" },
+	[0xF4] = { 3, SND_SEQ_EVENT_NONE        , STATUS_COMMON | STATUS_EXTENSION      , "Timestamp" },
+	[0xF5] = { 2, SND_SEQ_EVENT_NONE        , STATUS_COMMON | STATUS_EXTENSION      , "Cable select" },
+	[0xF6] = { 1, SND_SEQ_EVENT_TUNE_REQUEST, STATUS_COMMON                         , "Tune request" },
+	[0xF7] = { 1, SND_SEQ_EVENT_NONE        , STATUS_COMMON                         , "End of sysex" },
+	[0xF8] = { 1, SND_SEQ_EVENT_CLOCK       , STATUS_REALTIME                       , "Clock" },
+	[0xF9] = { 1, SND_SEQ_EVENT_NONE        , STATUS_REALTIME                       , "Undefined" },
+	[0xFA] = { 1, SND_SEQ_EVENT_START       , STATUS_REALTIME                       , "Start" },
+	[0xFB] = { 1, SND_SEQ_EVENT_CONTINUE    , STATUS_REALTIME                       , "Continue" },
+	[0xFC] = { 1, SND_SEQ_EVENT_STOP        , STATUS_REALTIME                       , "Stop" },
+	[0xFD] = { 1, SND_SEQ_EVENT_NONE        , STATUS_REALTIME                       , "Undefined" },
+	[0xFE] = { 1, SND_SEQ_EVENT_SENSING     , STATUS_REALTIME                       , "Active sensing" },
+	[0xFF] = { 3, SND_SEQ_EVENT_NONE        , STATUS_EXTENSION                      , "Text" },
+};
+
+/*
+	With --coalesce, controller, pitch bend and aftertouch values are held back
+	while more input is already waiting, and a newer value for the same port,
+	channel and controller (or key) replaces the held one in place. Everything
+	else flushes the held values first, so notes, sysex and controllers keep
+	their order around them; only clock and active sensing, which may occur
+	anywhere, go by without a flush. Once the input is drained, the held values
+	are sent, so under overload the output lags by at most one batch.
+
+	Bank select, data entry, (N)RPN numbers and channel mode controllers only
+	make sense in sequence, and switches (sustain, portamento, ...) must not
+	lose a press: those are never coalesced.
+*/
+
+#define COALESCE_BARRIER    0  // flush the held values, then send
+#define COALESCE_HOLD       1  // latest value wins
+#define COALESCE_PASS       2  // send at once, the held values stay
+
+typedef struct _coalesce
+{
+	snd_seq_event_t ev[COALESCE_SIZE];
+	int       port[COALESCE_SIZE];
+	long long due_ns[COALESCE_SIZE];
+	int count;
+	unsigned long merged;  // values replaced by a newer one
+} coalesce_t;
+
+coalesce_t rx_coalesce;  // serial -> ALSA
+coalesce_t tx_coalesce;  // ALSA -> serial
+
+int coalesce_kind(const snd_seq_event_t *ev)
+{
+	int param;
+
+	switch (ev->type)
+	{
+		case SND_SEQ_EVENT_CONTROLLER:
+			param = ev->data.control.param;
+			if (param == 0 || param == 32 || param == 6 || param == 38 || (param >= 64 && param <= 69) ||
+			    (param >= 96 && param <= 101) || param >= 120)
+				return COALESCE_BARRIER;
+			return COALESCE_HOLD;
+		case SND_SEQ_EVENT_PITCHBEND:
+		case SND_SEQ_EVENT_CHANPRESS:
+		case SND_SEQ_EVENT_KEYPRESS:
+			return COALESCE_HOLD;
+		case SND_SEQ_EVENT_CLOCK:
+		case SND_SEQ_EVENT_SENSING:
+			return COALESCE_PASS;
+		default:
+			return COALESCE_BARRIER;
+	}
+}
+
+/* Hold ev, replacing a held value for the same controller, returns FALSE when full */
+int coalesce_hold(coalesce_t *c, const snd_seq_event_t *ev, int port, long long due_ns)
+{
+	snd_seq_event_t *held;
+	int i;
+
+	for (i = 0; i < c->count; i++) {
+		held = &c->ev[i];
+		if (held->type != ev->type || c->port[i] != port ||
+		    held->data.control.channel != ev->data.control.channel)
+			continue;
+		if ((ev->type == SND_SEQ_EVENT_CONTROLLER && held->data.control.param != ev->data.control.param) ||
+		    (ev->type == SND_SEQ_EVENT_KEYPRESS && held->data.note.note != ev->data.note.note))
+			continue;
+		*held = *ev;
+		c->due_ns[i] = due_ns;
+		c->merged++;
+		return TRUE;
+	}
+	if (c->count == COALESCE_SIZE)
+		return FALSE;
+	c->ev[c->count] = *ev;
+	c->port[c->count] = port;
+	c->due_ns[c->count++] = due_ns;
+	return TRUE;
+}
+
+/*
+	With --rate, controller, pitch bend and aftertouch messages go through a
+	token bucket per channel and controller (or key) of each direction: a
+	message spends one period (1 / rate) of credit, and credit builds up with
+	time to at most RATE_BURST periods. A message arriving without credit is
+	thinned: it is kept as the value owed by its bucket, replaced by any newer
+	one, and sent once the bucket has refilled, so the last value of a stream
+	always gets through, at most one period late.
+
+	The most specific limit matching a message applies. The same controllers
+	as for --coalesce are exempt.
+*/
+
+typedef struct _rate_bucket
+{
+	long long credit_ns;   // time credit, one message spends period_ns
+	long long refill_ns;   // time credit was last updated
+	long long period_ns;
+	int rule;              // index in arguments.rate
+	int owed;              // ev was thinned and has to be sent when credit allows
+	snd_seq_event_t ev;
+	int       port;
+	long long due_ns;
+	struct _rate_bucket *next_owed;
+} rate_bucket_t;
+
+typedef struct _rate
+{
+	rate_bucket_t *buckets[MAX_RATES];  // per rule, [channel][controller or key] (a single one when the rule names it)
+	rate_bucket_t *owed;                // buckets with a thinned value to send
+	unsigned long thinned[MAX_RATES];   // values never sent, per rule
+} rate_t;
+
+rate_t rx_rate;  // serial -> ALSA
+rate_t tx_rate;  // ALSA -> serial
+
+int rate_keys(const rate_spec_t *spec)
+{
+	return (spec->param < 0 && spec->type != SND_SEQ_EVENT_PITCHBEND && spec->type != SND_SEQ_EVENT_CHANPRESS) ? 128 : 1;
+}
+
+void open_rate_limits(void)
+{
+	rate_t *rate[2] = { &rx_rate, &tx_rate };
+	int i, j, k, n;
+
+	for (i = 0; i < arguments.rate_count; i++) {
+		n = 16 * rate_keys(&arguments.rate[i]);
+		for (j = 0; j < 2; j++) {
+			if ((rate[j]->buckets[i] = calloc(n, sizeof(rate_bucket_t))) == NULL)
+			{
+				fprintf(stderr, "Error allocating rate limits.\n");
+				exit(1);
+			}
+			for (k = 0; k < n; k++) {
+				rate[j]->buckets[i][k].period_ns = NSEC_PER_SEC / arguments.rate[i].hz;
+				rate[j]->buckets[i][k].credit_ns = RATE_BURST * rate[j]->buckets[i][k].period_ns;
+				rate[j]->buckets[i][k].rule = i;
+			}
+		}
+	}
+}
+
+rate_bucket_t *rate_bucket(rate_t *r, const snd_seq_event_t *ev)
+{
+	const rate_spec_t *spec;
+	int channel = ev->data.control.channel & 0x0F;
+	int key = ev->type == SND_SEQ_EVENT_CONTROLLER ? ev->data.control.param :
+	          ev->type == SND_SEQ_EVENT_KEYPRESS   ? ev->data.note.note & 0x7F : 0;
+	int i, score, best = -1, best_score = -1;
+
+	for (i = 0; i < arguments.rate_count; i++) {
+		spec = &arguments.rate[i];
+		if (spec->type != ev->type || (spec->channel >= 0 && spec->channel != channel) ||
+		    (spec->param >= 0 && spec->param != key))
+			continue;
+		score = (spec->channel >= 0) + (spec->param >= 0);
+		if (score > best_score) {
+			best = i;
+			best_score = score;
+		}
+	}
+	if (best < 0)
+		return NULL;
+	return &r->buckets[best][channel * rate_keys(&arguments.rate[best]) + (rate_keys(&arguments.rate[best]) > 1 ? key : 0)];
+}
+
+void rate_refill(rate_bucket_t *b, long long now_ns)
+{
+	b->credit_ns += now_ns - b->refill_ns;
+	if (b->credit_ns > RATE_BURST * b->period_ns)
+		b->credit_ns = RATE_BURST * b->period_ns;
+	b->refill_ns = now_ns;
+}
+
+void rate_unlink_owed(rate_t *r, rate_bucket_t *b)
+{
+	rate_bucket_t **p;
+
+	for (p = &r->owed; *p != NULL; p = &(*p)->next_owed) {
+		if (*p == b) {
+			*p = b->next_owed;
+			break;
+		}
+	}
+	b->owed = FALSE;
+}
+
+/* Returns TRUE when ev is thinned, it is then owed by its bucket */
+int rate_limit(rate_t *r, const snd_seq_event_t *ev, int port, long long due_ns)
+{
+	rate_bucket_t *b;
+
+	if (arguments.rate_count == 0 || coalesce_kind(ev) != COALESCE_HOLD || (b = rate_bucket(r, ev)) == NULL)
+		return FALSE;
+
+	rate_refill(b, monotonic_ns());
+	if (b->owed)
+		r->thinned[b->rule]++;  // replaced by ev, either sent now or owed
+	if (b->credit_ns >= b->period_ns) {
+		b->credit_ns -= b->period_ns;
+		if (b->owed)
+			rate_unlink_owed(r, b);
+		return FALSE;
+	}
+
+	b->ev = *ev;
+	b->port = port;
+	b->due_ns = due_ns;
+	if (!b->owed) {
+		b->owed = TRUE;
+		b->next_owed = r->owed;
+		r->owed = b;
+	}
+	return TRUE;
+}
+
+/* Time the first owed value can be sent, 0 when none is owed */
+long long rate_next_due(const rate_t *r)
+{
+	const rate_bucket_t *b;
+	long long due_ns, next_ns = 0;
+
+	for (b = r->owed; b != NULL; b = b->next_owed) {
+		due_ns = b->refill_ns + b->period_ns - b->credit_ns;
+		if (next_ns == 0 || due_ns < next_ns)
+			next_ns = due_ns;
+	}
+	return next_ns;
+}
+
+/* Take an owed value whose bucket has refilled, NULL when there is none */
+rate_bucket_t *rate_due(rate_t *r, long long now_ns)
+{
+	rate_bucket_t *b;
+
+	for (b = r->owed; b != NULL; b = b->next_owed) {
+		rate_refill(b, now_ns);
+		if (b->credit_ns >= b->period_ns) {
+			b->credit_ns -= b->period_ns;
+			rate_unlink_owed(r, b);
+			return b;
+		}
+	}
+	return NULL;
+}
+
+/*
+	Events from the serial port go to the ALSA output buffer, and alsa_flush()
+	writes them to the sequencer in one go when the parser has used up what
+	one serial read returned, instead of one write per event.
+*/
+
+unsigned long alsa_events, alsa_writes;  // events sent to ALSA, and the writes they took
+
+void send_event_now(snd_seq_t* seq, int port_out_id, snd_seq_event_t *ev, long long due_ns)
+{
+	set_event_time(ev, due_ns);
+	snd_seq_ev_set_source(ev, port_out_id);
+	snd_seq_ev_set_subs(ev);
+
+	/* the buffer is drained when full, only an event bigger than the whole buffer fails */
+	if (snd_seq_event_output(seq, ev) < 0) {
+		snd_seq_event_output_direct(seq, ev);
+		alsa_writes++;
+	}
+	alsa_events++;
+}
+
+void alsa_flush(snd_seq_t* seq)
+{
+	if (snd_seq_event_output_pending(seq) > 0) {
+		snd_seq_drain_output(seq);
+		alsa_writes++;
+	}
+}
+
+void send_coalesced(snd_seq_t* seq)
+{
+	int i;
+
+	for (i = 0; i < rx_coalesce.count; i++)
+		send_event_now(seq, rx_coalesce.port[i], &rx_coalesce.ev[i], rx_coalesce.due_ns[i]);
+	rx_coalesce.count = 0;
+}
+
+/* Send the values owed by --rate that are due, the others stay owed */
+void send_rate_limited(snd_seq_t* seq)
+{
+	rate_bucket_t *b;
+	long long now_ns = monotonic_ns();
+
+	while ((b = rate_due(&rx_rate, now_ns)) != NULL)
+		send_event_now(seq, b->port, &b->ev, b->due_ns > now_ns ? b->due_ns : now_ns);
+}
+
+/* Send ev to ALSA, unless --rate thins it or --coalesce holds it back because more serial input is waiting */
+void send_event(snd_seq_t* seq, int port_out_id, snd_seq_event_t *ev, long long due_ns)
+{
+	if (rate_limit(&rx_rate, ev, port_out_id, due_ns))
+		return;
+
+	if (arguments.coalesce) {
+		switch (coalesce_kind(ev))
+		{
+			case COALESCE_HOLD:
+				if (coalesce_hold(&rx_coalesce, ev, port_out_id, due_ns)) {
+					if (rx_head == rx_tail)
+						send_coalesced(seq);
+					return;
+				}
+				/* fall through */
+			case COALESCE_BARRIER:
+				send_coalesced(seq);
+				break;
+		}
+	}
+	send_event_now(seq, port_out_id, ev, due_ns);
+}
+
+/* Fill ev from a complete message, SND_SEQ_EVENT_NONE when it is not forwarded */
+void decode_midi_command(const unsigned char *buf, int buflen, snd_seq_event_t *ev)
+{
+	const midi_status_t *status = &midi_status[buf[0]];
+	unsigned char channel, param1, param2;
+	int value14;
+
+	snd_seq_ev_clear(ev);
+
+	channel = (status->flags & STATUS_CHANNEL) ? buf[0] & 0x0F : 0;
+	param1  = buflen > 1 ? buf[1] : 0;
+	param2  = buflen > 2 ? buf[2] : 0;
+	value14 = param1 | (param2 << 7);
+
+	ev->type = status->type;
+	switch (status->flags & 0x0F)
+	{
+		case STATUS_DATA_NOTE:
+			ev->data.note.channel  = channel;
+			ev->data.note.note     = param1;
+			ev->data.note.velocity = param2;
+			break;
+		case STATUS_DATA_CONTROL:
+			ev->data.control.channel = channel;
+			ev->data.control.param   = param1;
+			ev->data.control.value   = param2;
+			break;
+		case STATUS_DATA_VALUE:
+			ev->data.control.channel = channel;
+			ev->data.control.value   = param1;
+			break;
+		case STATUS_DATA_VALUE14:
+			ev->data.control.value   = value14;
+			break;
+		case STATUS_DATA_BEND:
+			ev->data.control.channel = channel;
+			ev->data.control.value   = value14 - 8192;  // in alsa MIDI we want signed int
+			break;
+	}
+}
+
+void parse_midi_command(snd_seq_t* seq, int port_out_id, unsigned char *buf, int buflen, long long due_ns)
+{
+	const midi_status_t *status = &midi_status[buf[0]];
+	snd_seq_event_t ev;
+	unsigned char param1 = buflen > 1 ? buf[1] : 0, param2 = buflen > 2 ? buf[2] : 0;
+
+	decode_midi_command(buf, buflen, &ev);
+
+	if (!arguments.silent && (arguments.verbose || ev.type == SND_SEQ_EVENT_NONE)) {
+		if (ev.type == SND_SEQ_EVENT_NONE)
+			printf("Serial  %02X Unknown MIDI cmd   %02X", buf[0] & 0xF0, buf[0] & 0x0F);
+		else
+			printf("Serial  %02X %-18s %02X", buf[0] & 0xF0, status->name, buf[0] & 0x0F);
+		if ((status->flags & 0x0F) >= STATUS_DATA_VALUE14)
+			printf(" %04X", param1 | (param2 << 7));
+		else if (buflen > 1)
+			printf(buflen > 2 ? " %02X %02X" : " %02X", param1, param2);
+		printf("\n");
+		fflush(stdout);
+	}
+
+	if (ev.type != SND_SEQ_EVENT_NONE)
+		send_event(seq, port_out_id, &ev, due_ns);
+}
+
+/* Send one sysex chunk: the first one starts with F0, the last one ends with F7 */
+void send_sysex(snd_seq_t* seq, int port_out_id, unsigned char *buf, int buflen, long long due_ns)
+{
+	snd_seq_event_t ev;
+	int i;
+
+	if (!arguments.silent && arguments.verbose) {
+		printf("Serial  F0 Sysex len = %04X   ", buflen);
+		for (i=0; i < buflen; i++) {
+			printf("%02X ", buf[i]);
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	snd_seq_ev_clear(&ev);
+	snd_seq_ev_set_sysex(&ev, buflen, buf);
+	send_event(seq, port_out_id, &ev, due_ns);
+}
+
+/*
+	Sysex bytes are handed to ALSA straight from the receive ring: the event
+	points into rx_buf, and the data is copied to the kernel while it is sent,
+	so the held bytes can be released right after. A span crossing the end of
+	the ring goes out as two chunks.
+*/
+void send_held_sysex(snd_seq_t* seq, int port_out_id, long long due_ns)
+{
+	unsigned int pos = rx_hold & RX_MASK;
+	unsigned int len = rx_head - rx_hold;
+
+	if (len == 0) return;
+	if (pos + len > RX_BUF_SIZE) {
+		send_sysex(seq, port_out_id, rx_buf + pos, RX_BUF_SIZE - pos, due_ns);
+		len -= RX_BUF_SIZE - pos;
+		pos = 0;
+	}
+	send_sysex(seq, port_out_id, rx_buf + pos, len, due_ns);
+	rx_hold = rx_head;
+}
+
+/*
+	ALSA events are encoded through alsa_encoding[], indexed by event type: the
+	status byte to send (channel added for channel messages) and how the event
+	data maps to wire bytes. A whole batch of events is encoded into tx_buf,
+	then written to serial with a single writev(). Sysex payloads are not
+	copied: the iovec list points at the event data, which stays valid until
+	the end of the batch.
+*/
+
+#define ENCODE_NONE        0  // no MIDI 1.0 equivalent
+#define ENCODE_NOTE        1  // status|ch, note, velocity
+#define ENCODE_CONTROL     2  // status|ch, param, value
+#define ENCODE_VALUE       3  // status|ch, value
+#define ENCODE_BEND        4  // status|ch, 14-bit value + 8192, LSB first
+#define ENCODE_VALUE14     5  // status, 14-bit value, LSB first
+#define ENCODE_VALUE7      6  // status, value
+#define ENCODE_SINGLE      7  // status only
+#define ENCODE_CONTROL14   8  // controller MSB (param), then LSB (param + 32) for params < 32
+#define ENCODE_PARAM       9  // (N)RPN number on controllers first_cc / first_cc-1, data entry 6 / 38
+#define ENCODE_SYSEX      10  // variable length data, sent unchanged
+
+#define ENCODE_MAX_LEN    12  // Longest encoding of a fixed length event ((N)RPN)
+
+typedef struct _alsa_encoding
+{
+	unsigned char status;
+	unsigned char kind;
+	unsigned char first_cc;  // ENCODE_PARAM only
+	const char   *name;
+} alsa_encoding_t;
+
+const alsa_encoding_t alsa_encoding[256] =
+{
+	[SND_SEQ_EVENT_NOTEOFF]      = { 0x80, ENCODE_NOTE     , 0  , "Note off" },
+	[SND_SEQ_EVENT_NOTEON]       = { 0x90, ENCODE_NOTE     , 0  , "Note on" },
+	[SND_SEQ_EVENT_KEYPRESS]     = { 0xA0, ENCODE_NOTE     , 0  , "Pressure change" },
+	[SND_SEQ_EVENT_CONTROLLER]   = { 0xB0, ENCODE_CONTROL  , 0  , "Controller change" },
+	[SND_SEQ_EVENT_PGMCHANGE]    = { 0xC0, ENCODE_VALUE    , 0  , "Program change" },
+	[SND_SEQ_EVENT_CHANPRESS]    = { 0xD0, ENCODE_VALUE    , 0  , "Channel press" },
+	[SND_SEQ_EVENT_PITCHBEND]    = { 0xE0, ENCODE_BEND     , 0  , "Pitch bend" },
+	[SND_SEQ_EVENT_CONTROL14]    = { 0xB0, ENCODE_CONTROL14, 0  , "Controller 14 bit" },
+	[SND_SEQ_EVENT_NONREGPARAM]  = { 0xB0, ENCODE_PARAM    , 99 , "NRPN" },
+	[SND_SEQ_EVENT_REGPARAM]     = { 0xB0, ENCODE_PARAM    , 101, "RPN" },
+	[SND_SEQ_EVENT_SYSEX]        = { 0xF0, ENCODE_SYSEX    , 0  , "Sysex" },
+	[SND_SEQ_EVENT_QFRAME]       = { 0xF1, ENCODE_VALUE7   , 0  , "Quarter frame" },
+	[SND_SEQ_EVENT_SONGPOS]      = { 0xF2, ENCODE_VALUE14  , 0  , "Song position" },
+	[SND_SEQ_EVENT_SONGSEL]      = { 0xF3, ENCODE_VALUE7   , 0  , "Song select" },
+	[SND_SEQ_EVENT_TUNE_REQUEST] = { 0xF6, ENCODE_SINGLE   , 0  , "Tune request" },
+	[SND_SEQ_EVENT_CLOCK]        = { 0xF8, ENCODE_SINGLE   , 0  , "Clock" },
+	[SND_SEQ_EVENT_START]        = { 0xFA, ENCODE_SINGLE   , 0  , "Start" },
+	[SND_SEQ_EVENT_CONTINUE]     = { 0xFB, ENCODE_SINGLE   , 0  , "Continue" },
+	[SND_SEQ_EVENT_STOP]         = { 0xFC, ENCODE_SINGLE   , 0  , "Stop" },
+	[SND_SEQ_EVENT_SENSING]      = { 0xFE, ENCODE_SINGLE   , 0  , "Active sensing" },
+	[SND_SEQ_EVENT_RESET]        = { 0xFF, ENCODE_SINGLE   , 0  , "Reset" },
+};
+
+/*
+	The encoded bytes of each event are tagged with a priority class and the
+	virtual cable they go to. When nothing is queued and the whole batch fits
+	in the kernel serial buffer (see --txqueue), it is written as it is, with
+	a single writev() and without a copy. Otherwise each class is copied to
+	its own queue, and tx_pump() writes queued bytes as the kernel buffer
+	drains, picking:
+
+	- real time messages (clock, transport) first, even in the middle of a
+	  sysex as MIDI allows, as long as they go to the cable of that sysex;
+	- then channel voice and system common messages, between sysex messages
+	  only, as their status byte would end one. Note on and off go before
+	  controllers, pitch bend and aftertouch queued earlier, so a note off
+	  does not wait behind a stream of them. Other messages (program change,
+	  bank select, pedals, RPN...) are a barrier: nothing goes before one
+	  queued earlier, nor after one queued later, as they change what the
+	  notes mean;
+	- then sysex. Sysex that waited TX_BULK_PATIENCE writes while channel
+	  messages went out goes first for one, so it always makes progress.
+
+	The real time and channel queues hold up to --backlog of output at the
+	baud rate each. When the ALSA input outruns the serial link, the ALSA
+	thread waits for room in tx_enqueue(), so the events back up in ALSA,
+	where --coalesce and --rate thin them out, instead of in queues seconds
+	long. Sysex is taken whole without waiting, as clocks and notes read
+	after it have to overtake it: the ALSA thread only stops reading input
+	while more than half of the sysex queue is taken (see tx_bulk_full()).
+
+	With --sysex-gap, the next sysex waits for the gap of the previous one,
+	counted from the time its F7 leaves the wire (the bytes ahead of it in the
+	kernel buffer at the baud rate), while the other classes go on.
+
+	Cable selects are added as the bytes are written, since the classes
+	change the order of messages for different cables.
+*/
+
+#define TX_REALTIME         0
+#define TX_NOTE             1  // note on and off
+#define TX_CONTROL          2  // values --coalesce may hold, see coalesce_kind()
+#define TX_CHANNEL          3  // other channel voice and system common messages
+#define TX_BULK             4
+#define TX_CLASSES          5
+
+#define TX_QUEUE_MASK  (TX_QUEUE_SIZE - 1)
+
+typedef struct _tx_record
+{
+	unsigned int len;
+	int cable;
+	unsigned int order;  // tx_order when queued
+} tx_record_t;
+
+typedef struct _tx_queue
+{
+	unsigned char data[TX_QUEUE_SIZE];
+	unsigned int head, tail;     // bytes, free running like rx_head and rx_tail
+	tx_record_t record[TX_RECORDS];
+	unsigned int first, last;    // records, free running
+	unsigned int sent;           // bytes of the first record already written
+	unsigned int high_water;
+} tx_queue_t;
+
+unsigned char tx_buf[TX_BUF_SIZE];
+int tx_len;
+struct iovec tx_iov[TX_IOV_MAX];
+unsigned char tx_iov_class[TX_IOV_MAX];
+unsigned char tx_iov_cable[TX_IOV_MAX];
+int tx_iov_cnt;
+int tx_sysex;  // the batch holds sysex data, which goes through the queues when there are sysex gaps
+
+tx_queue_t tx_queue[TX_CLASSES];
+int tx_cable = -1;     // cable last selected on the serial link, -1 to select it again
+int tx_open = -1;      // class that has to go on: a record is partly written, or a sysex lacks its F7
+int tx_bulk_waiting;   // writes sysex waited behind channel messages
+unsigned int tx_order; // records queued so far, to keep the order of the channel classes
+long long tx_wake_ns;  // time the kernel buffer has room again for queued bytes
+
+int tx_gap = -1;             // --sysex-gap rule of the sysex being written, -1 for none
+unsigned int tx_gap_len;     // bytes of that sysex written so far
+long long tx_bulk_ready_ns;  // time the gap after the last sysex ends
+unsigned long tx_gaps;       // gaps kept
+
+/* A new connection has no cable selected yet */
+void tx_link_check(void)
+{
+	static unsigned long connections;
+
+	if (connections != link_connections) {
+		connections = link_connections;
+		tx_cable = -1;
+	}
+}
+
+int tx_queued(void)
+{
+	int c;
+
+	for (c = 0; c < TX_CLASSES; c++)
+		if (tx_queue[c].first != tx_queue[c].last)
+			return TRUE;
+	return FALSE;
+}
+
+/* Rule of --sysex-gap for a sysex starting with these bytes, -1 when none applies */
+int sysex_gap_rule(const unsigned char *header, int len)
+{
+	const gap_spec_t *gap;
+	int id = -1, model = -1, i, score, best = -1, best_score = -1;
+
+	/* the model byte follows the device ID, after a 1 or 3 byte manufacturer ID */
+	if (len >= 2 && header[1] != 0x00) {
+		id = header[1];
+		model = len >= 4 ? header[3] : -1;
+	} else if (len >= 4) {
+		id = 0x10000 | header[2] << 8 | header[3];
+		model = len >= 6 ? header[5] : -1;
+	}
+
+	for (i = 0; i < arguments.gap_count; i++) {
+		gap = &arguments.gap[i];
+		if ((gap->id >= 0 && gap->id != id) || (gap->model >= 0 && gap->model != model))
+			continue;
+		score = (gap->id >= 0) + (gap->model >= 0);
+		if (score > best_score) {
+			best = i;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
+/* Channel class to write from next: notes, then controllers, unless a barrier was queued before them */
+int tx_pick_channel(void)
+{
+	tx_queue_t *barrier = &tx_queue[TX_CHANNEL], *q;
+	int c;
+
+	for (c = TX_NOTE; c <= TX_CONTROL; c++) {
+		q = &tx_queue[c];
+		if (q->first != q->last && (barrier->first == barrier->last ||
+		    (int)(q->record[q->first % TX_RECORDS].order - barrier->record[barrier->first % TX_RECORDS].order) < 0))
+			return c;
+	}
+	return barrier->first != barrier->last ? TX_CHANNEL : -1;
+}
+
+/* Class to write from next, -1 when all queues are empty or sysex waits for its gap */
+int tx_pick(long long now_ns)
+{
+	tx_queue_t *rt = &tx_queue[TX_REALTIME];
+	int realtime = rt->first != rt->last;
+	int channel  = tx_pick_channel();
+	int bulk     = tx_queue[TX_BULK].first != tx_queue[TX_BULK].last &&
+	               (tx_open == TX_BULK || now_ns >= tx_bulk_ready_ns);
+
+	if (realtime && (tx_open < 0 || arguments.cables == 1 || rt->record[rt->first % TX_RECORDS].cable == tx_cable))
+		return TX_REALTIME;
+	if (tx_open >= 0 && tx_queue[tx_open].first != tx_queue[tx_open].last)
+		return tx_open;
+	if (realtime)
+		return TX_REALTIME;  // nothing left of what was open, it ends here
+	if (bulk && (tx_bulk_waiting >= TX_BULK_PATIENCE || channel < 0))
+		return TX_BULK;
+	return channel;
+}
+
+/* Write queued bytes as far as the kernel buffer allows, and work out when to come back for the others */
+void tx_pump(void)
+{
+	unsigned char out[TX_BUF_SIZE], header[6];
+	tx_queue_t *q;
+	tx_record_t *rec;
+	unsigned int n, i;
+	int room, outq, len = 0, c, bulk_sent = FALSE;
+	long long now_ns = monotonic_ns();
+	long long byte_ns = NSEC_PER_SEC * 10 / arguments.baudrate_bps;
+
+	tx_link_check();
+	room = tx_kernel_room(&outq);
+	if (arguments.txqueue == 0 || room > TX_BUF_SIZE) room = TX_BUF_SIZE;
+
+	while (len < room && (c = tx_pick(now_ns)) >= 0) {
+		q = &tx_queue[c];
+		rec = &q->record[q->first % TX_RECORDS];
+
+		/* a new sysex: find its gap rule in the header */
+		if (c == TX_BULK && q->sent == 0 && q->data[q->head & TX_QUEUE_MASK] == 0xF0) {
+			for (i = 0; i < sizeof(header) && i < rec->len; i++)
+				header[i] = q->data[(q->head + i) & TX_QUEUE_MASK];
+			tx_gap = sysex_gap_rule(header, i);
+			tx_gap_len = 0;
+		}
+
+		if (arguments.cables > 1 && rec->cable != tx_cable) {
+			if (room - len < 3) break;
+			out[len++] = CABLE_SELECT;
+			out[len++] = rec->cable;
+			tx_cable = rec->cable;
+		}
+
+		n = rec->len - q->sent;
+		if (n > (unsigned int)(room - len)) n = room - len;
+		for (i = 0; i < n; i++)
+			out[len++] = q->data[(q->head + i) & TX_QUEUE_MASK];
+		q->head += n;
+		q->sent += n;
+		if (q->sent == rec->len) {
+			q->first++;
+			q->sent = 0;
+		}
+
+		/* the end of a sysex: the next one waits until the gap after it is over */
+		if (c == TX_BULK) {
+			tx_gap_len += n;
+			if (q->sent == 0 && out[len - 1] == 0xF7 && tx_gap >= 0) {
+				tx_bulk_ready_ns = now_ns + (outq + len) * byte_ns + arguments.gap[tx_gap].ms * NSEC_PER_MSEC +
+					(long long)arguments.gap[tx_gap].us_per_byte * tx_gap_len * 1000;
+				tx_gap = -1;
+				tx_gaps++;
+			}
+		}
+
+		if (q->sent > 0)
+			tx_open = c;  // the rest of the record goes next
+		else if (c == TX_BULK)
+			tx_open = out[len - 1] != 0xF7 ? TX_BULK : -1;
+		else if (c != TX_REALTIME || tx_open == TX_REALTIME)
+			tx_open = -1;
+		bulk_sent |= c == TX_BULK;
+	}
+
+	if (len > 0) {
+		serial_write(out, len);
+		if (arguments.framing == FRAMING_COBS)
+			tx_cable = -1;  // see tx_flush()
+		if (bulk_sent || tx_queue[TX_BULK].first == tx_queue[TX_BULK].last)
+			tx_bulk_waiting = 0;
+		else
+			tx_bulk_waiting++;
+	}
+
+	/* come back once half of what the kernel buffer holds now has gone out, or when the gap is over */
+	if (tx_queued() && tx_pick(now_ns) < 0)
+		tx_wake_ns = tx_bulk_ready_ns;
+	else
+		tx_wake_ns = now_ns + (outq + len) / 2 * byte_ns;
+}
+
+/* Bytes each queue may hold with --backlog */
+unsigned int tx_backlog_limit(void)
+{
+	long long limit = (long long)arguments.backlog * arguments.baudrate_bps / 10 / 1000;
+
+	if (arguments.backlog == 0 || limit > TX_QUEUE_SIZE)
+		return TX_QUEUE_SIZE;
+	return limit < TX_BACKLOG_MIN ? TX_BACKLOG_MIN : limit;
+}
+
+/* The queue has no room for part more bytes: a record larger than the backlog only goes into an empty one */
+int tx_full(const tx_queue_t *q, unsigned int part, unsigned int limit)
+{
+	unsigned int queued = q->tail - q->head;
+
+	return (queued > 0 && queued + part > limit) || TX_QUEUE_SIZE - queued < part ||
+	       q->last - q->first == TX_RECORDS;
+}
+
+/* The sysex queue is too full to take more: ALSA input waits, the other queues go on */
+int tx_bulk_full(void)
+{
+	return tx_queue[TX_BULK].tail - tx_queue[TX_BULK].head > TX_QUEUE_SIZE / 2;
+}
+
+/* Copy bytes to the queue of their class, waiting for room as long as it takes */
+void tx_enqueue(int c, int cable, const unsigned char *data, unsigned int len)
+{
+	tx_queue_t *q = &tx_queue[c];
+	unsigned int part, pos, n, limit = c == TX_BULK ? TX_QUEUE_SIZE : tx_backlog_limit();
+	long long wait_ns;
+
+	while (len > 0) {
+		part = len < TX_QUEUE_SIZE / 4 ? len : TX_QUEUE_SIZE / 4;
+		while (tx_full(q, part, limit)) {
+			if (!run) return;  // closing down
+			tx_pump();
+			wait_ns = tx_wake_ns - monotonic_ns();
+			if (tx_full(q, part, limit) && wait_ns > 0)
+				poll(NULL, 0, (wait_ns + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC);
+		}
+
+		pos = q->tail & TX_QUEUE_MASK;
+		n = pos + part > TX_QUEUE_SIZE ? TX_QUEUE_SIZE - pos : part;
+		memcpy(q->data + pos, data, n);
+		memcpy(q->data, data + n, part - n);
+		q->tail += part;
+		q->record[q->last % TX_RECORDS].len = part;
+		q->record[q->last % TX_RECORDS].cable = cable;
+		q->record[q->last % TX_RECORDS].order = tx_order++;
+		q->last++;
+		if (q->tail - q->head > q->high_water)
+			q->high_water = q->tail - q->head;
+
+		data += part;
+		len  -= part;
+	}
+}
+
+void tx_flush(void)
+{
+	static unsigned char select[MAX_CABLES][2];
+	struct iovec out[2 * TX_IOV_MAX];
+	int i, n = 0, len = 0, room = -1, outq, cable;
+
+	tx_link_check();
+	if (tx_iov_cnt > 0 && !tx_queued()) {
+		for (i = 0; i < tx_iov_cnt; i++)
+			len += tx_iov[i].iov_len + 2;  // with a cable select
+		room = arguments.txqueue > 0 ? tx_kernel_room(&outq) : len;
+	}
+
+	/* without --txqueue the kernel buffer is not looked at otherwise: sample it for the flow control report */
+	if (tx_iov_cnt > 0 && arguments.txqueue == 0 && arguments.flow_control != FLOW_NONE)
+		tx_kernel_room(&outq);
+
+	if (len <= room && !(tx_sysex && arguments.gap_count > 0)) {
+		/* written as it is: one writev straight from the batch */
+		for (i = 0; i < tx_iov_cnt; i++) {
+			cable = tx_iov_cable[i];
+			if (arguments.cables > 1 && cable != tx_cable) {
+				select[cable][0] = CABLE_SELECT;
+				select[cable][1] = cable;
+				out[n].iov_base = select[cable];
+				out[n++].iov_len = 2;
+				tx_cable = cable;
+			}
+			out[n++] = tx_iov[i];
+			if (tx_iov_class[i] == TX_BULK)
+				tx_open = ((unsigned char *)tx_iov[i].iov_base)[tx_iov[i].iov_len - 1] != 0xF7 ? TX_BULK : -1;
+			else if (tx_iov_class[i] != TX_REALTIME)
+				tx_open = -1;
+		}
+		serial_writev(out, n);
+	} else if (tx_iov_cnt > 0) {
+		for (i = 0; i < tx_iov_cnt; i++)
+			tx_enqueue(tx_iov_class[i], tx_iov_cable[i], tx_iov[i].iov_base, tx_iov[i].iov_len);
+		tx_pump();
+	}
+	tx_len = 0;
+	tx_iov_cnt = 0;
+	tx_sysex = FALSE;
+
+	/* each batch goes out in its own frames, which must not depend on a cable select in a lost one */
+	if (arguments.framing == FRAMING_COBS)
+		tx_cable = -1;
+}
+
+/* Copy encoded bytes into tx_buf, growing the last iovec when it ends there with the same class and cable */
+void tx_append(const unsigned char *data, int len, int c, int cable)
+{
+	struct iovec *last;
+
+	/* batches beyond the backlog are written first, so a queued record stays within it */
+	if (tx_len + len > TX_BUF_SIZE || tx_iov_cnt == TX_IOV_MAX || tx_len + len > (int)tx_backlog_limit())
+		tx_flush();
+	memcpy(tx_buf + tx_len, data, len);
+	last = &tx_iov[tx_iov_cnt > 0 ? tx_iov_cnt - 1 : 0];
+	if (tx_iov_cnt > 0 && (unsigned char *)last->iov_base + last->iov_len == tx_buf + tx_len &&
+	    tx_iov_class[tx_iov_cnt - 1] == c && tx_iov_cable[tx_iov_cnt - 1] == cable) {
+		last->iov_len += len;
+	} else {
+		tx_iov[tx_iov_cnt].iov_base = tx_buf + tx_len;
+		tx_iov[tx_iov_cnt].iov_len = len;
+		tx_iov_class[tx_iov_cnt] = c;
+		tx_iov_cable[tx_iov_cnt++] = cable;
+	}
+	tx_len += len;
+}
+
+/* Reference data that stays valid until the next tx_flush(), without copying it */
+void tx_append_ref(const void *data, int len, int c, int cable)
+{
+	if (tx_iov_cnt == TX_IOV_MAX)
+		tx_flush();
+	tx_iov[tx_iov_cnt].iov_base = (void *)data;
+	tx_iov[tx_iov_cnt].iov_len = len;
+	tx_iov_class[tx_iov_cnt] = c;
+	tx_iov_cable[tx_iov_cnt++] = cable;
+}
+
+/* Encode one ALSA event at the end of tx_buf */
+void write_event_to_serial_port(snd_seq_event_t* ev)
+{
+	const alsa_encoding_t *enc = &alsa_encoding[ev->type];
+	unsigned char bytes[ENCODE_MAX_LEN], *p = bytes;
+	unsigned char channel = ev->data.control.channel & 0x0F;
+	unsigned int  param = ev->data.control.param & 0x3FFF;
+	int value = ev->data.control.value;
+	int cable, c, i;
+
+	if (enc->kind == ENCODE_NONE) {
+		if (!arguments.silent) {
+			printf("Alsa    -- Unknown event type %02X\n", ev->type);
+			fflush(stdout);
+		}
+		return;
+	}
+
+	/* the cable select is added when the bytes are written */
+	cable = cable_of_port(ev->dest.port);
+	if (enc->kind == ENCODE_SYSEX)
+		c = TX_BULK;
+	else if (enc->status >= 0xF8)
+		c = TX_REALTIME;
+	else if (enc->status == 0x80 || enc->status == 0x90)
+		c = TX_NOTE;
+	else
+		c = coalesce_kind(ev) == COALESCE_HOLD ? TX_CONTROL : TX_CHANNEL;
+
+	switch (enc->kind)
+	{
+		case ENCODE_NOTE:
+			*p++ = enc->status | (ev->data.note.channel & 0x0F);
+			*p++ = ev->data.note.note & 0x7F;
+			*p++ = ev->data.note.velocity & 0x7F;
+			break;
+		case ENCODE_CONTROL:
+			*p++ = enc->status | channel;
+			*p++ = param & 0x7F;
+			*p++ = value & 0x7F;
+			break;
+		case ENCODE_VALUE:
+			*p++ = enc->status | channel;
+			*p++ = value & 0x7F;
+			break;
+		case ENCODE_BEND:
+			value += 8192;
+			/* fall through */
+		case ENCODE_VALUE14:
+			*p++ = enc->status | (enc->kind == ENCODE_BEND ? channel : 0);
+			*p++ = value & 0x7F;
+			*p++ = (value >> 7) & 0x7F;
+			break;
+		case ENCODE_VALUE7:
+			*p++ = enc->status;
+			*p++ = value & 0x7F;
+			break;
+		case ENCODE_SINGLE:
+			*p++ = enc->status;
+			break;
+		case ENCODE_CONTROL14:
+			*p++ = enc->status | channel;
+			if (param < 32) {
+				*p++ = param;
+				*p++ = (value >> 7) & 0x7F;
+				*p++ = param + 32;  // running status within this message
+				*p++ = value & 0x7F;
+			} else {
+				*p++ = param & 0x7F;
+				*p++ = value & 0x7F;
+			}
+			break;
+		case ENCODE_SYSEX:
+			break;  // payload appended below, without a copy into bytes
+		case ENCODE_PARAM:
+			*p++ = enc->status | channel;
+			*p++ = enc->first_cc;
+			*p++ = param >> 7;
+			*p++ = enc->first_cc - 1;
+			*p++ = param & 0x7F;
+			*p++ = 6;
+			*p++ = (value >> 7) & 0x7F;
+			*p++ = 38;
+			*p++ = value & 0x7F;
+			break;
+	}
+
+	if (!arguments.silent && arguments.verbose) {
+		if (enc->kind == ENCODE_SYSEX) {
+			printf("Alsa    F0 Sysex len = %04X   ", ev->data.ext.len);
+			for (i = 0; i < ev->data.ext.len; i++)
+				printf("%02X ", ((unsigned char*)ev->data.ext.ptr)[i]);
+		} else {
+			printf("Alsa    %02X %-18s %02X", bytes[0] & 0xF0, enc->name, bytes[0] & 0x0F);
+			for (i = 1; i < p - bytes; i++)
+				printf(" %02X", bytes[i]);
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	if (p > bytes)
+		tx_append(bytes, p - bytes, c, cable);
+	if (enc->kind == ENCODE_SYSEX) {
+		tx_append_ref(ev->data.ext.ptr, ev->data.ext.len, c, cable);
+		tx_sysex = TRUE;
+	}
+}
+
+/*
+	Events sent to the bridge for direct delivery with an absolute real time
+	stamp in the future, read on the clock of the bridge's named queue, wait
+	in a min-heap keyed by due time. A timerfd armed on the earliest one
+	releases them to serial, which gives sequencers submitting ahead of time
+	sub-millisecond output accuracy. Events scheduled on a queue are already
+	delivered by ALSA when due and go out as they arrive.
+*/
+
+typedef struct _sched_event
+{
+	long long due_ns;
+	unsigned long order;  // keeps events due at the same time in arrival order
+	snd_seq_event_t ev;
+} sched_event_t;
+
+sched_event_t sched_heap[SCHED_SIZE];
+int sched_len;
+unsigned long sched_order;
+int sched_timer = -1;
+
+int sched_before(const sched_event_t *a, const sched_event_t *b)
+{
+	return a->due_ns < b->due_ns || (a->due_ns == b->due_ns && a->order < b->order);
+}
+
+void sched_arm_timer(void)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (sched_len > 0) {
+		its.it_value.tv_sec  = sched_heap[0].due_ns / NSEC_PER_SEC;
+		its.it_value.tv_nsec = sched_heap[0].due_ns % NSEC_PER_SEC;
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+			its.it_value.tv_nsec = 1;  // a zero value would disarm the timer
+	}
+	timerfd_settime(sched_timer, TFD_TIMER_ABSTIME, &its, NULL);
+}
 
-int open_seq(snd_seq_t** seq)
+/* Keep ev for later if it is stamped in the future, returns FALSE when it should be sent now */
+int schedule_event(snd_seq_event_t *ev)
 {
-	int port_out_id, port_in_id; // actually port_in_id is not needed nor used anywhere
+	sched_event_t item, tmp;
+	long long due_ns;
+	int i, parent;
+
+	if (sched_timer < 0 || ev->queue != SND_SEQ_QUEUE_DIRECT ||
+	    !snd_seq_ev_is_real(ev) || !snd_seq_ev_is_abstime(ev))
+		return FALSE;
+
+	due_ns = queue_start_ns + ev->time.time.tv_sec * NSEC_PER_SEC + ev->time.time.tv_nsec;
+	if (due_ns <= monotonic_ns() || sched_len == SCHED_SIZE)
+		return FALSE;
+
+	item.due_ns = due_ns;
+	item.order  = sched_order++;
+	item.ev     = *ev;
+	if (snd_seq_ev_is_variable(ev)) {
+		/* the event input buffer is reused, so variable length data needs its own copy */
+		if ((item.ev.data.ext.ptr = pool_alloc(ev->data.ext.len)) == NULL)
+			return FALSE;
+		memcpy(item.ev.data.ext.ptr, ev->data.ext.ptr, ev->data.ext.len);
+	}
 
-	if (snd_seq_open(seq, "default", SND_SEQ_OPEN_DUPLEX, 0) < 0)
-	{
-		fprintf(stderr, "Error opening ALSA sequencer.\n");
-		exit(1);
+	i = sched_len++;
+	sched_heap[i] = item;
+	while (i > 0 && sched_before(&sched_heap[i], &sched_heap[parent = (i - 1) / 2])) {
+		tmp = sched_heap[i]; sched_heap[i] = sched_heap[parent]; sched_heap[parent] = tmp;
+		i = parent;
 	}
+	if (i == 0) sched_arm_timer();
+	return TRUE;
+}
 
-	snd_seq_set_client_name(*seq, arguments.name);
+/* Send every scheduled event that is due, and re-arm the timer for the next one */
+void release_scheduled_events(void)
+{
+	sched_event_t item, tmp;
+	unsigned long long expirations;
+	long long now_ns = monotonic_ns();
+	int i, child;
+
+	read(sched_timer, &expirations, sizeof(expirations));
+
+	while (sched_len > 0 && sched_heap[0].due_ns <= now_ns) {
+		item = sched_heap[0];
+		sched_heap[0] = sched_heap[--sched_len];
+		i = 0;
+		while ((child = 2 * i + 1) < sched_len) {
+			if (child + 1 < sched_len && sched_before(&sched_heap[child + 1], &sched_heap[child]))
+				child++;
+			if (!sched_before(&sched_heap[child], &sched_heap[i]))
+				break;
+			tmp = sched_heap[i]; sched_heap[i] = sched_heap[child]; sched_heap[child] = tmp;
+			i = child;
+		}
 
-	if ((port_out_id = snd_seq_create_simple_port(*seq, "MIDI out",
-					SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ,
-					SND_SEQ_PORT_TYPE_MIDI_GENERIC|SND_SEQ_PORT_TYPE_APPLICATION)) < 0)  // *new*
-	{
-		fprintf(stderr, "Error creating sequencer MIDI out port.\n");  // *new*
+		write_event_to_serial_port(&item.ev);
+		if (snd_seq_ev_is_variable(&item.ev)) {
+			tx_flush();  // the batch points at the copied data
+			pool_free(item.ev.data.ext.ptr);
+		}
 	}
+	tx_flush();
+	sched_arm_timer();
+}
+
+void write_coalesced(void)
+{
+	int i;
+
+	for (i = 0; i < tx_coalesce.count; i++)
+		write_event_to_serial_port(&tx_coalesce.ev[i]);
+	tx_coalesce.count = 0;
+}
 
-	if ((port_in_id = snd_seq_create_simple_port(*seq, "MIDI in",
-					SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE,
-					SND_SEQ_PORT_TYPE_MIDI_GENERIC|SND_SEQ_PORT_TYPE_APPLICATION)) < 0)  // *new*
+/* Encode ev, or hold it back while more ALSA input is waiting (see --coalesce) */
+void write_coalesced_event(snd_seq_event_t* ev, int backlogged)
+{
+	switch (coalesce_kind(ev))
 	{
-		fprintf(stderr, "Error creating sequencer MIDI in port.\n");  // *new*
+		case COALESCE_HOLD:
+			if (coalesce_hold(&tx_coalesce, ev, ev->dest.port, 0)) {
+				if (!backlogged)
+					write_coalesced();
+				return;
+			}
+			/* fall through */
+		case COALESCE_BARRIER:
+			write_coalesced();
+			break;
 	}
+	write_event_to_serial_port(ev);
+}
+
+/* Write the values owed by --rate that are due, the others stay owed */
+void write_rate_limited(void)
+{
+	rate_bucket_t *b;
+	long long now_ns = monotonic_ns();
 
-	return port_out_id;
+	while ((b = rate_due(&tx_rate, now_ns)) != NULL)
+		write_event_to_serial_port(&b->ev);
+	tx_flush();
 }
 
-void parse_midi_command(snd_seq_t* seq, int port_out_id, unsigned char *buf, int buflen)  // *new*
+void write_midi_action_to_serial_port(snd_seq_t* seq_handle)
 {
-/*
-	MIDI COMMANDS
-	-------------------------------------------------------------------
-	name                 status      param 1          param 2
-	-------------------------------------------------------------------
-	note off             0x80+C       key #            velocity
-	note on              0x90+C       key #            velocity
-	poly key pressure    0xA0+C       key #            pressure value
-	control change       0xB0+C       control #        control value
-	program change       0xC0+C       program #        --
-	mono key pressure    0xD0+C       pressure value   --
-	pitch bend           0xE0+C       range (LSB)      range (MSB)
-	system               0xF0+C       manufacturer     model
-	-------------------------------------------------------------------
-	C is the channel number, from 0 to 15;
-	-------------------------------------------------------------------
-	source: http://ftp.ec.vanderbilt.edu/computermusic/musc216site/MIDI.Commands.html
+	snd_seq_event_t* ev;
+	int err;
 
-	In this program the pitch bend range will be transmitter as
-	one single 8-bit number. So the end result is that MIDI commands
-	will be transmitted as 3 bytes, starting with the operation byte:
+	do
+	{
+		/* on error there is no event to encode, ev still points at the previous one */
+		if ((err = snd_seq_event_input(seq_handle, &ev)) < 0) {
+			if (err == -ENOSPC && !arguments.silent) {
+				printf("Alsa    -- Input overrun, events lost\n");
+				fflush(stdout);
+			}
+			if (err != -ENOSPC) break;
+			continue;
+		}
 
-	buf[0] --> operation/channel
-	buf[1] --> param1
-	buf[2] --> param2        (param2 not transmitted on program change or key press)
-*/
+		/* events stamped in the future wait in the scheduler, the others go out now unless thinned */
+		if (arguments.passthrough)
+			write_event_to_serial_port(ev);
+		else if (!schedule_event(ev) && !rate_limit(&tx_rate, ev, ev->dest.port, 0)) {
+			if (arguments.coalesce)
+				write_coalesced_event(ev, snd_seq_event_input_pending(seq_handle, 0) > 0);
+			else
+				write_event_to_serial_port(ev);
+		}
 
-	snd_seq_event_t ev;
-	snd_seq_ev_clear(&ev);
-	snd_seq_ev_set_direct(&ev);
-	snd_seq_ev_set_source(&ev, port_out_id);
-	snd_seq_ev_set_subs(&ev);
+		snd_seq_free_event(ev);
 
-	unsigned char operation, channel, param1, param2;  // *new* was int in original code
-	int int_param1;  // *new*
+	} while (snd_seq_event_input_pending(seq_handle, 0) > 0);
 
-	operation = buf[0] & 0xF0;
-	channel   = buf[0] & 0x0F;
-	param1    = buf[1] & 0xFF;  // *new* (protection ?)
-	param2    = buf[2] & 0xFF;  // *new* (protection ?)
+	write_coalesced();
+	tx_flush();
+}
 
-	switch (operation)
-	{
-		case 0x90:  // *new* handle noteon first to speed up the mostly used message
-			if (!arguments.silent && arguments.verbose) {
-				printf("Serial  %02X Note on            %02X %02X %02X\n", operation, channel, param1, param2);
-				fflush(stdout);  // *new*
-			}
-			snd_seq_ev_set_noteon(&ev, channel, param1, param2);
-			break;
+/*
+	With --rawmidi, the bridge works on byte streams: what the serial reader
+	gets (after COBS decoding) is written to the rawmidi device as it is, and
+	what the device sends is queued for the serial port as it is, with no
+	event decoding or encoding on the way.
+*/
 
-		case 0x80:
-			if (!arguments.silent && arguments.verbose) {
-				printf("Serial  %02X Note off           %02X %02X %02X\n", operation, channel, param1, param2);
-				fflush(stdout);  // *new*
-			}
-			snd_seq_ev_set_noteoff(&ev, channel, param1, param2);
-			break;
+snd_rawmidi_t *rawmidi_in, *rawmidi_out;
 
-		case 0xA0:
-			if (!arguments.silent && arguments.verbose) {
-				printf("Serial  %02X Pressure change    %02X %02X %02X\n", operation, channel, param1, param2);
-				fflush(stdout);  // *new*
-			}
-			snd_seq_ev_set_keypress(&ev, channel, param1, param2);
-			break;
+void print_bytes(const char *prefix, const unsigned char *data, int len)
+{
+	int i;
 
-		case 0xB0:
-			if (!arguments.silent && arguments.verbose) {
-				printf("Serial  %02X Controller change  %02X %02X %02X\n", operation, channel, param1, param2);
-				fflush(stdout);  // *new*
-			}
-			snd_seq_ev_set_controller(&ev, channel, param1, param2);
-			break;
+	printf("%s", prefix);
+	for (i = 0; i < len; i++)
+		printf(" %02X", data[i]);
+	printf("\n");
+	fflush(stdout);
+}
 
-		case 0xC0:
-			if (!arguments.silent && arguments.verbose) {
-				printf("Serial  %02X Program change     %02X %02X\n", operation, channel, param1);
-				fflush(stdout);  // *new*
-			}
-			snd_seq_ev_set_pgmchange(&ev, channel, param1);
-			break;
+void open_rawmidi(void)
+{
+	int err;
 
-		case 0xD0:
-			if (!arguments.silent && arguments.verbose) {
-				printf("Serial  %02X Channel press      %02X %02X\n", operation, channel, param1);
-				fflush(stdout);  // *new*
-			}
-			snd_seq_ev_set_chanpress(&ev, channel, param1);
-			break;
+	if ((err = snd_rawmidi_open(&rawmidi_in, &rawmidi_out, arguments.rawmidi, SND_RAWMIDI_NONBLOCK)) < 0) {
+		fprintf(stderr, "Error opening ALSA rawmidi device %s: %s\n", arguments.rawmidi, snd_strerror(err));
+		exit(1);
+	}
+	/* the serial reader waits for the device to take its bytes, the ALSA thread polls for input */
+	snd_rawmidi_nonblock(rawmidi_out, 0);
+}
 
-		case 0xE0:
-			int_param1 = (int) (param1 & 0x7F) + ((param2 & 0x7F) << 7);  // *new*
-			if (!arguments.silent && arguments.verbose) {
-				printf("Serial  %02X Pitch bend         %02X %04X\n", operation, channel, int_param1);  // *new*
-				fflush(stdout);  // *new*
-			}
-			snd_seq_ev_set_pitchbend(&ev, channel, int_param1 - 8192); // in alsa MIDI we want signed int *new*
-			break;
+/* Serial -> rawmidi: write the bytes of one serial read to the device */
+void write_serial_to_rawmidi(void)
+{
+	unsigned char *data;
+	int len;
 
-		case 0xF0:  // *new*
-			if (buf[0] == 0xF0) {
-				if (!arguments.silent && arguments.verbose) {
-					printf("Serial  %02X Sysex len = %04X   ", operation, buflen);  // *new*
-					int i;
-					for (i=0; i < buflen; i++) {
-						printf("%02X ", buf[i]);
-					}
-					printf("\n");
-					fflush(stdout);  // *new*
-				}
-				// Send sysex message
-				snd_seq_ev_set_sysex(&ev, buflen, buf);
-			}
-			break;
+	rx_fill();
+	data = rx_buf + (rx_head & RX_MASK);
+	len = rx_tail - rx_head;  // rx_fill() starts over at 0 while no sysex is held, no wrap-around
+	rx_head = rx_tail;
 
-		default:
-			if (!arguments.silent) {  // *new*
-				printf("Serial  %02X Unknown MIDI cmd   %02X %02X %02X\n", operation, channel, param1, param2);  // *new*
-				fflush(stdout);  // *new*
-			}
-			break;
-	}
+	snd_rawmidi_write(rawmidi_out, data, len);
 
-	snd_seq_event_output_direct(seq, &ev);
-	snd_seq_drain_output(seq);
+	if (!arguments.silent && arguments.verbose)
+		print_bytes("Serial ", data, len);
 }
 
-void write_midi_action_to_serial_port(snd_seq_t* seq_handle)
+/* Rawmidi -> serial: queue what the device has for the serial port */
+void write_rawmidi_to_serial_port(void)
 {
-	snd_seq_event_t* ev;
-	unsigned char bytes[] = {0x00, 0x00, 0xFF};  // *new*
-	unsigned char sysex_data[256];  // *new*
-	int sysex_len = 0;  // *new*
+	unsigned char data[TX_BUF_SIZE];
+	ssize_t len;
 
-	do
-	{
-		snd_seq_event_input(seq_handle, &ev);
-
-		switch (ev->type)
-		{
+	while ((len = snd_rawmidi_read(rawmidi_in, data, sizeof(data))) > 0) {
+		tx_append(data, len, TX_CHANNEL, 0);
 
-			case SND_SEQ_EVENT_NOTEOFF:
-				bytes[0] = 0x80 + ev->data.control.channel;
-				bytes[1] = ev->data.note.note;
-				bytes[2] = ev->data.note.velocity;
-				if (!arguments.silent && arguments.verbose) {
-					printf("Alsa    %02X Note off           %02X %02X %02X\n", bytes[0]&0xF0, bytes[0]&0xF, bytes[1], bytes[2]);
-					fflush(stdout);  // *new*
-				}
-				break;
+		if (!arguments.silent && arguments.verbose)
+			print_bytes("Alsa   ", data, len);
+	}
+	tx_flush();
+}
 
-			case SND_SEQ_EVENT_NOTEON:
-				bytes[0] = 0x90 + ev->data.control.channel;
-				bytes[1] = ev->data.note.note;
-				bytes[2] = ev->data.note.velocity;
-				if (!arguments.silent && arguments.verbose) {
-					printf("Alsa    %02X Note on            %02X %02X %02X\n", bytes[0]&0xF0, bytes[0]&0xF, bytes[1], bytes[2]);
-					fflush(stdout);  // *new*
-				}
-				break;
+/*
+	With --passthrough, serial input skips the ttymidi parser: each read goes
+	through ALSA's snd_midi_event encoder, which only tracks message boundaries
+	and running status, and the events it completes are sent in one ALSA write.
+	Sysex longer than the encoder buffer (RX_BUF_SIZE) is sent in chunks.
+	The other way, events skip the scheduler, --coalesce and --rate, and go
+	straight to the table driven encoder in write_event_to_serial_port().
+*/
 
-			case SND_SEQ_EVENT_KEYPRESS:
-				bytes[0] = 0xA0 + ev->data.control.channel;  // *new* was 90 in original code
-				bytes[1] = ev->data.note.note;
-				bytes[2] = ev->data.note.velocity;
-				if (!arguments.silent && arguments.verbose) {
-					printf("Alsa    %02X Pressure change    %02X %02X %02X\n", bytes[0]&0xF0, bytes[0]&0xF, bytes[1], bytes[2]);
-					fflush(stdout);  // *new*
-				}
-				break;
+snd_midi_event_t *rx_midi_event;
 
-			case SND_SEQ_EVENT_CONTROLLER:
-				bytes[0] = 0xB0 + ev->data.control.channel;
-				bytes[1] = ev->data.control.param;
-				bytes[2] = ev->data.control.value;
-				if (!arguments.silent && arguments.verbose) {
-					printf("Alsa    %02X Controller change  %02X %02X %02X\n", bytes[0]&0xF0, bytes[0]&0xF, bytes[1], bytes[2]);
-					fflush(stdout);  // *new*
-				}
-				break;
+void open_passthrough(void)
+{
+	if (snd_midi_event_new(RX_BUF_SIZE, &rx_midi_event) < 0) {
+		fprintf(stderr, "Error creating ALSA MIDI event encoder.\n");
+		exit(1);
+	}
+}
 
-			case SND_SEQ_EVENT_PGMCHANGE:
-				bytes[0] = 0xC0 + ev->data.control.channel;
-				bytes[1] = ev->data.control.value;
-				if (!arguments.silent && arguments.verbose) {
-					printf("Alsa    %02X Program change     %02X %02X %02X\n", bytes[0]&0xF0, bytes[0]&0xF, bytes[1], bytes[2]);
-					fflush(stdout);  // *new*
-				}
-				break;
+/* Serial -> alsa: encode the bytes of one serial read into events and send them */
+void write_serial_passthrough(snd_seq_t* seq)
+{
+	snd_seq_event_t ev;
+	unsigned char *data;
+	long len, n;
 
-			case SND_SEQ_EVENT_CHANPRESS:
-				bytes[0] = 0xD0 + ev->data.control.channel;
-				bytes[1] = ev->data.control.value;
-				if (!arguments.silent && arguments.verbose) {
-					printf("Alsa    %02X Channel press      %02X %02X %02X\n", bytes[0]&0xF0, bytes[0]&0xF, bytes[1], bytes[2]);
-					fflush(stdout);  // *new*
-				}
-				break;
+	rx_fill();
+	data = rx_buf + (rx_head & RX_MASK);
+	len = rx_tail - rx_head;  // rx_fill() starts over at 0 while no sysex is held, no wrap-around
+	rx_head = rx_tail;
 
-			case SND_SEQ_EVENT_PITCHBEND:
-				bytes[0] = 0xE0 + (unsigned char)ev->data.control.channel;  // *new*
-				ev->data.control.value += 8192;
-				bytes[1] = (unsigned char)(ev->data.control.value & 0x7F);  // *new*
-				bytes[2] = (unsigned char)(ev->data.control.value >> 7);  // *new*
-				if (!arguments.silent && arguments.verbose) {
-					printf("Alsa    %02X Pitch bend         %02X %04X\n", bytes[0]&0xF0, bytes[0]&0xF, ev->data.control.value);
-					fflush(stdout);  // *new*
-				}
-				break;
+	if (!arguments.silent && arguments.verbose)
+		print_bytes("Serial ", data, len);
 
-			case SND_SEQ_EVENT_SYSEX:  // *new*
-				sysex_len = ev->data.ext.len;
-				if (!arguments.silent && arguments.verbose) printf("Alsa    F0 Sysex len = %04X   ", sysex_len);
-				int i;
-				for (i=0; i<sysex_len; i++) {
-					unsigned char* valPtr = (unsigned char*)ev->data.ext.ptr;  // *new*
-					unsigned char val = valPtr[i];  // *new*
-					if (!arguments.silent && arguments.verbose) printf("%02X ", val);  // *new* unsigned char cast suppressed
-					sysex_data[i] = val & 0xFF;  // *new* &0xFF (protection ?)
-				}
-				if (!arguments.silent && arguments.verbose) {
-					printf("\n");  // *new*
-					fflush(stdout);  // *new*
-				}
-				break;
+	while (len > 0) {
+		snd_seq_ev_clear(&ev);
+		if ((n = snd_midi_event_encode(rx_midi_event, data, len, &ev)) <= 0)
+			break;
+		data += n;
+		len -= n;
+		if (ev.type != SND_SEQ_EVENT_NONE)
+			send_event_now(seq, port_out_ids[0], &ev, rx_time_ns);
+	}
+	alsa_flush(seq);
+}
 
-			default:
-				if (!arguments.silent) {  // *new*
-					printf("Alsa    %02X Unknown MIDI cmd   %02X %02X %02X\n", bytes[0]&0xF0, bytes[0]&0x0F, bytes[1], bytes[2]);  // *new*
-					fflush(stdout);  // *new*
-				}
-				break;
-		}
 /*
-		bytes[0] = bytes[0] & 0xFF;  // *new* &0xFF (protection ?)
-		bytes[1] = bytes[1] & 0xFF;  // *new* &0xFF (protection ?)
-		bytes[2] = bytes[2] & 0xFF;  // *new* &0xFF (protection ?)
+	With --benchmark, the ALSA thread sends a probe every BENCH_PROBE_MS: the sysex
+	F0 7D 62 6D s0 s1 s2 s3 F7, with a sequence number 7 bits per byte. When it comes
+	back over the serial input, it is not forwarded: the time from tx_append() to
+	the read() returning it goes into the report, so it covers the transmit queues,
+	the link both ways and the --read strategy, under whatever traffic is running.
 */
-		// *new* sysex addition
-		if (sysex_len > 0) {
-			write(serial, sysex_data, sysex_len);
-			tcdrain(serial);  // *new* (speed up ?)
-		} else {
-			if (bytes[0]!=0x00)
-			{
-				bytes[1] = (bytes[1] & 0x7F); // just to be sure that one bit is really zero
-				if (bytes[2]==0xFF) {
-					write(serial, bytes, 2);
-				} else {
-					bytes[2] = (bytes[2] & 0x7F);
-					write(serial, bytes, 3);
-				}
-			}
-		}
 
-		snd_seq_free_event(ev);
+#define BENCH_PROBE_LEN  9
 
-	} while (snd_seq_event_input_pending(seq_handle, 0) > 0);
+long long bench_start_ns, bench_next_ns;
+long long bench_sent_ns[256];  // send time of the last 256 probes, by sequence number
+unsigned long bench_sent, bench_returned;
+unsigned int bench_rtt_us[BENCH_SAMPLES];
+int bench_samples;
+
+void bench_send_probe(void)
+{
+	unsigned char probe[BENCH_PROBE_LEN] = { 0xF0, 0x7D, 0x62, 0x6D, 0, 0, 0, 0, 0xF7 };
+	unsigned long seq = bench_sent;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		probe[4 + i] = (seq >> (7 * i)) & 0x7F;
+	bench_sent_ns[seq & 0xFF] = monotonic_ns();
+	bench_sent = seq + 1;
+	bench_next_ns = bench_sent_ns[seq & 0xFF] + BENCH_PROBE_MS * NSEC_PER_MSEC;
+
+	tx_append(probe, BENCH_PROBE_LEN, TX_BULK, 0);
+	tx_flush();
+}
+
+/* The sysex held in the receive ring is complete: take it if it is a probe, FALSE otherwise */
+int bench_probe_returned(void)
+{
+	unsigned char probe[BENCH_PROBE_LEN];
+	unsigned long seq = 0;
+	int i;
+
+	if (arguments.benchmark == 0 || rx_head - rx_hold != BENCH_PROBE_LEN)
+		return FALSE;
+	for (i = 0; i < BENCH_PROBE_LEN; i++)
+		probe[i] = rx_buf[(rx_hold + i) & RX_MASK];
+	if (probe[1] != 0x7D || probe[2] != 0x62 || probe[3] != 0x6D)
+		return FALSE;
+
+	for (i = 0; i < 4; i++)
+		seq |= (unsigned long)probe[4 + i] << (7 * i);
+	if (seq < bench_sent && bench_sent - seq <= 256 && bench_samples < BENCH_SAMPLES)
+		bench_rtt_us[bench_samples++] = (rx_time_ns - bench_sent_ns[seq & 0xFF]) / 1000;
+	bench_returned++;
+	rx_hold = rx_head;
+	return TRUE;
 }
 
 void* read_midi_from_alsa(void* seq)
 {
-	int npfd;
+	int npfd, i, alsa_ready, bulk_full, timeout, pauses = 1;
+	long long next_ns;
 	struct pollfd* pfd;
 	snd_seq_t* seq_handle;
 
 	seq_handle = seq;
 
-	npfd = snd_seq_poll_descriptors_count(seq_handle, POLLIN);
-	pfd = (struct pollfd*) alloca(npfd * sizeof(struct pollfd));
-	snd_seq_poll_descriptors(seq_handle, pfd, npfd, POLLIN);
+	if (rawmidi_in != NULL) {
+		npfd = snd_rawmidi_poll_descriptors_count(rawmidi_in);
+		pfd = (struct pollfd*) alloca((npfd + 1) * sizeof(struct pollfd));
+		snd_rawmidi_poll_descriptors(rawmidi_in, pfd, npfd);
+	} else {
+		npfd = snd_seq_poll_descriptors_count(seq_handle, POLLIN);
+		pfd = (struct pollfd*) alloca((npfd + 1) * sizeof(struct pollfd));
+		snd_seq_poll_descriptors(seq_handle, pfd, npfd, POLLIN);
+	}
+
+	/* the last descriptor is the scheduler timer */
+	if (queue_id >= 0)
+		sched_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	pfd[npfd].fd = sched_timer;
+	pfd[npfd].events = POLLIN;
 
 	while (run)
 	{
-		if (poll(pfd,npfd, 100) > 0)
+		/* wake up in time for the next value owed by --rate, and to move queued output on */
+		timeout = 100;
+		if ((next_ns = rate_next_due(&tx_rate)) != 0) {
+			next_ns = (next_ns - monotonic_ns() + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+			timeout = next_ns < 0 ? 0 : next_ns < timeout ? next_ns : timeout;
+		}
+		if (tx_queued()) {
+			next_ns = (tx_wake_ns - monotonic_ns() + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+			timeout = next_ns < 0 ? 0 : next_ns < timeout ? next_ns : timeout;
+		}
+		if (arguments.benchmark > 0) {
+			next_ns = (bench_next_ns - monotonic_ns() + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+			timeout = next_ns < 0 ? 0 : next_ns < timeout ? next_ns : timeout;
+		}
+		if (udp_sync_ns != 0) {
+			next_ns = (udp_sync_ns - monotonic_ns() + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+			timeout = next_ns < 0 ? 0 : next_ns < timeout ? next_ns : timeout;
+		}
+		if (arguments.read_mode == READ_SPIN)
+			timeout = 0;
+
+		/* while the sysex queue is full, ALSA input waits and only the scheduler timer is watched */
+		bulk_full = tx_bulk_full();
+		if (poll(bulk_full ? pfd + npfd : pfd, bulk_full ? 1 : npfd + 1, timeout) > 0)
 		{
-			write_midi_action_to_serial_port(seq_handle);
+			pauses = 1;
+			if (pfd[npfd].revents & POLLIN)
+				release_scheduled_events();
+			for (i = 0, alsa_ready = FALSE; i < npfd && !bulk_full; i++)
+				alsa_ready |= pfd[i].revents & POLLIN;
+			if (alsa_ready && rawmidi_in != NULL)
+				write_rawmidi_to_serial_port();
+			else if (alsa_ready)
+				write_midi_action_to_serial_port(seq_handle);
 		}
+		else if (arguments.read_mode == READ_SPIN)
+		{
+			spin_pause(&pauses);
+		}
+		if (tx_rate.owed != NULL)
+			write_rate_limited();
+		if (tx_queued())
+			tx_pump();
+		if (arguments.benchmark > 0 && monotonic_ns() >= bench_next_ns)
+			bench_send_probe();
+		if (udp_sync_ns != 0 && monotonic_ns() >= udp_sync_ns)
+			udp_send_sync();
 	}
 
 	printf("\nStopping [PC]->[Hardware] communication...");
@@ -524,16 +3257,20 @@ void* read_midi_from_alsa(void* seq)
 void* read_midi_from_serial_port(void* seq)
 {
 	unsigned char buf[BUF_SIZE], msg[MAX_MSG_SIZE];  // *new*
-	int i, msglen, bytesleft;  // *new* (buflen in JW's code not used)
+	unsigned char byte;
+	const midi_status_t *status;
+	int i = 0, msglen;  // *new* (buflen in JW's code not used)
+	int rx_cable = 0;  // cable selected by the last F5 nn prefix
+	long long due_ns = 0;  // delivery time from the last F4 ll mm prefix, 0 when none
+	unsigned long frames_dropped = 0;
+	unsigned long connections = 0;
 
-	/* Lets first fast forward to first status byte... */
-	if (!arguments.printonly) {
-		do {
-			read(serial, buf, 1);
-			buf[0] = buf[0] & 0xFF;  // *new* &0xFF (protection ?)
-		}
-		while (buf[0] >> 7 == 0);
-	}
+	/*
+	 * buf[0] holds the running status (0 when there is none) and buf[1 .. i-1]
+	 * the data bytes received so far. Sysex bytes are not copied to buf but
+	 * held in the receive ring (see send_held_sysex).
+	 */
+	buf[0] = 0x00;
 
 	while (run)
 	{
@@ -544,69 +3281,123 @@ void* read_midi_from_serial_port(void* seq)
 
 		if (arguments.printonly)
 		{
-			read(serial, buf, 1);
+			if (serial_read(buf, 1) < 1) continue;
 			printf("%02X ", buf[0]&0xFF);  // *new*
 			fflush(stdout);
 			continue;
 		}
 
-		/*
-		 * so let's align to the beginning of a midi command.
-		 */
+		if (rawmidi_out != NULL)
+		{
+			write_serial_to_rawmidi();
+			continue;
+		}
 
-		// int i = 1; *new*
-		i = 1;  // *new* (i already declared at function start)
-		bytesleft = BUF_SIZE - 1;  // *new*
+		if (arguments.passthrough)
+		{
+			write_serial_passthrough(seq);
+			continue;
+		}
 
-		while (i < bytesleft) {  // *new*
-			read(serial, buf+i, 1);
-			buf[i] = buf[i] & 0xFF;  // *new* &0xFF (protection ?)
+		if (rx_holding)
+		{
+			/* inside a sysex, skip the data bytes already received in one step */
+			if (serial_skip_data_run() > 0)
+				continue;
 
-			if (buf[i] >> 7 != 0) {
-				/* Status byte received and will always be first bit!*/
-				if(buf[i] == 0xF7 && buf[0] == 0xF0)	//if end of SysEx message has been reached *new*
-				{
-					i++;  // *new* (added wrt EB's code)
-					break;
-				}
-				buf[0] = buf[i];
-				if(buf[0] != 0xF0)	//if not SysEx *new*
-					bytesleft = 3;
-				i = 1;
-			} else {
-				if(buf[0] == 0xF0)	//if SysEx *new*
-				{
-					i++;
-				}
-				else
-				{
-					/* Data byte received */
-					if (i == 2) {
-						/* It was 2nd data byte so we have a MIDI event
-						   process! */
-						i = 3;
-					} else {
-						/* Lets figure out are we done or should we read one more byte. */
-						if ((buf[0] & 0xF0) == 0xC0 || (buf[0] & 0xF0) == 0xD0) {
-							i = 3;
-						} else {
-							i = 2;
-						}
-					}
-				}
+			/* everything received is held: hand it over before the ring runs out of room */
+			if (rx_head == rx_tail && rx_free() < RX_MIN_READ)
+				send_held_sysex(seq, port_out_ids[rx_cable], due_ns ? due_ns : rx_time_ns);
+		}
+
+		/* nothing left to parse: send the values held back, the owed values now due and the buffered events before waiting for more */
+		if (rx_head == rx_tail) {
+			if (rx_coalesce.count > 0)
+				send_coalesced(seq);
+			if (rx_rate.owed != NULL)
+				send_rate_limited(seq);  // even when more input is ready at once, as under overload
+			alsa_flush(seq);
+			while (rx_rate.owed != NULL && !serial_wait(rate_next_due(&rx_rate))) {
+				send_rate_limited(seq);
+				alsa_flush(seq);
+			}
+		}
+
+		byte = serial_read_byte();
+
+		/* a frame was lost: drop the partial message, the new frame starts on a message boundary */
+		if (frames_dropped != rx_frames_dropped) {
+			frames_dropped = rx_frames_dropped;
+			rx_holding = FALSE;
+			buf[0] = 0x00;
+		}
+
+		/* a new connection: no running status, cable or timestamp from the old one */
+		if (connections != link_connections) {
+			connections = link_connections;
+			buf[0] = 0x00;
+			rx_cable = 0;
+			due_ns = 0;
+		}
+
+		status = &midi_status[byte];
+
+		if (status->flags & STATUS_REALTIME)
+		{
+			/* a real time byte inside a sysex is not part of it: send what comes before, skip it */
+			if (rx_holding) {
+				rx_head--;
+				send_held_sysex(seq, port_out_ids[rx_cable], due_ns ? due_ns : rx_time_ns);
+				rx_hold = ++rx_head;
 			}
+			parse_midi_command(seq, port_out_ids[rx_cable], &byte, 1, rx_time_ns);
+			continue;
+		}
 
+		if (byte & 0x80)
+		{
+			/* any status byte ends a sysex, only F7 completes it */
+			if (rx_holding) {
+				if (byte == 0xF7 && !bench_probe_returned())
+					send_held_sysex(seq, port_out_ids[rx_cable], due_ns ? due_ns : rx_time_ns);
+				rx_holding = FALSE;
+				if (byte == 0xF7) {
+					due_ns = 0;
+					buf[0] = 0x00;
+					continue;
+				}
+			}
+			buf[0] = byte;
+			i = 1;
+			if (byte == 0xF0) {
+				rx_hold = rx_head - 1;  // the F0 just read
+				rx_holding = TRUE;
+				continue;
+			}
+		}
+		else if (rx_holding)
+		{
+			continue;  // sysex data byte, stays in the ring
+		}
+		else
+		{
+			if (buf[0] == 0x00) continue;  // no running status, wait for the next status byte
+			buf[i++] = byte;
 		}
 
+		status = &midi_status[buf[0]];
+		if (i < status->length) continue;
+		i = 1;
+
 		/* print text comment message (the ones that start with 0xFF 0x00 0x00 */
 		if ((buf[0] == 0xFF) && (buf[1] == 0x00) && (buf[2] == 0x00))  // *new* removed (char) casts
 		{
-			read(serial, buf, 1);
-			buf[0] = buf[0] & 0xFF;  // *new* &0xFF (protection ?)
-			msglen = buf[0];
+			buf[0] = 0x00;
+			alsa_flush(seq);  // the text may take a while to arrive
+			msglen = serial_read_byte();
 			if (msglen > MAX_MSG_SIZE-1) msglen = MAX_MSG_SIZE-1;
 
-			read(serial, msg, msglen);
+			serial_read_bytes(msg, msglen);
 
 			if (arguments.silent) continue;
 
@@ -615,12 +3406,34 @@ void* read_midi_from_serial_port(void* seq)
 
 			printf("Serial  FF Text len = %04X    %s\n", msglen, msg);  // *new*
 			fflush(stdout);
+			continue;
+		}
+
+		/* cable select prefix: route the following messages to another port pair */
+		if (buf[0] == CABLE_SELECT && arguments.cables > 1)
+		{
+			if (buf[1] < arguments.cables) {
+				rx_cable = buf[1];
+			} else if (!arguments.silent) {
+				printf("Serial  F5 Unknown cable      %02X\n", buf[1]);
+				fflush(stdout);
+			}
+		}
+
+		/* device timestamp prefix: schedule the following message */
+		else if (buf[0] == TIMESTAMP && arguments.latency > 0)
+		{
+			due_ns = device_time_to_host(buf[1] | (buf[2] << 7), rx_time_ns);
 		}
 
 		/* parse MIDI message */
 		else {
-			parse_midi_command(seq, port_out_id, buf, i);  // *new* (was i+1 in EB's code)
+			parse_midi_command(seq, port_out_ids[rx_cable], buf, status->length, due_ns ? due_ns : rx_time_ns);  // *new* (was i+1 in EB's code)
+			due_ns = 0;
 		}
+
+		if (status->flags & (STATUS_COMMON | STATUS_EXTENSION))
+			buf[0] = 0x00;  // system common message, cancels running status
 	}
 }
 
@@ -628,29 +3441,220 @@ void* read_midi_from_serial_port(void* seq)
 /* --------------------------------------------------------------------- */
 // Main program
 
+int compare_uint(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+	return x < y ? -1 : x > y;
+}
+
+void print_benchmark(void)
+{
+	struct rusage usage;
+	double wall, user, system;
+
+	getrusage(RUSAGE_SELF, &usage);
+	wall = (monotonic_ns() - bench_start_ns) / 1e9;
+	user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+	system = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+
+	printf("\nBenchmark --read %s, %.1f s: CPU user %.3f s, system %.3f s (%.2f%%)",
+		read_mode_names[arguments.read_mode], wall, user, system, 100 * (user + system) / wall);
+	printf("\nSerial reads %lu, %lu bytes, %.1f bytes per read, %.1f reads per second",
+		rx_reads, rx_bytes, rx_reads ? (double)rx_bytes / rx_reads : 0.0, rx_reads / wall);
+	printf("\nEvents to ALSA %lu in %lu writes", alsa_events, alsa_writes);
+	printf("\nProbes sent %lu, returned %lu", bench_sent, bench_returned);
+
+	if (bench_samples > 0) {
+		qsort(bench_rtt_us, bench_samples, sizeof(bench_rtt_us[0]), compare_uint);
+		printf("\nProbe round trip: min %.3f, median %.3f, 99%% %.3f, max %.3f ms",
+			bench_rtt_us[0] / 1e3, bench_rtt_us[bench_samples / 2] / 1e3,
+			bench_rtt_us[bench_samples * 99 / 100] / 1e3, bench_rtt_us[bench_samples - 1] / 1e3);
+	}
+}
+
+/*
+	--benchmark decode measures the serial decoder alone: a synthetic stream of
+	channel messages (half of them in running status), system common messages
+	and clocks is split into messages through midi_status[] and decoded into
+	events the way read_midi_from_serial_port() does, over and over for a
+	second, without a device, ALSA or prints in the way.
+*/
+void bench_decode(void)
+{
+	static unsigned char stream[BENCH_DECODE_SIZE];
+	static const unsigned char kinds[] = { 0x90, 0x80, 0xB0, 0xB0, 0xE0, 0xA0, 0xC0, 0xD0, 0xF1, 0xF2, 0xF3, 0xF6, 0xF8 };
+	const midi_status_t *status;
+	snd_seq_event_t ev;
+	unsigned char buf[BUF_SIZE], byte, last = 0x00;
+	unsigned long events = 0, bytes = 0, check = 0;
+	long long start_ns, wall_ns;
+	int len = 0, i = 1, j;
+
+	srand(1);
+	while (len + 3 <= BENCH_DECODE_SIZE) {
+		byte = kinds[rand() % sizeof(kinds)];
+		if (byte < 0xF0)
+			byte |= rand() & 0x0F;
+		if (byte != last || (rand() & 1))
+			stream[len++] = byte;
+		if (byte < 0xF0)
+			last = byte;
+		else if (byte < 0xF8)
+			last = 0x00;
+		for (j = 1; j < midi_status[byte].length; j++)
+			stream[len++] = rand() & 0x7F;
+	}
+
+	buf[0] = 0x00;
+	start_ns = monotonic_ns();
+	do {
+		for (j = 0; j < len; j++) {
+			byte = stream[j];
+			status = &midi_status[byte];
+
+			if (status->flags & STATUS_REALTIME) {
+				decode_midi_command(&byte, 1, &ev);
+				check += ev.type;
+				events++;
+				continue;
+			}
+
+			if (byte & 0x80) {
+				buf[0] = byte;
+				i = 1;
+			} else {
+				if (buf[0] == 0x00) continue;
+				buf[i++] = byte;
+			}
+
+			status = &midi_status[buf[0]];
+			if (i < status->length) continue;
+			i = 1;
+
+			decode_midi_command(buf, status->length, &ev);
+			check += ev.type + ev.data.control.value;
+			events++;
+			if (status->flags & (STATUS_COMMON | STATUS_EXTENSION))
+				buf[0] = 0x00;
+		}
+		bytes += len;
+		wall_ns = monotonic_ns() - start_ns;
+	} while (wall_ns < NSEC_PER_SEC);
+
+	printf("Decoded %lu events from %lu bytes in %.3f s: %.0f events/s, %.1f MB/s (check %08lX)\n",
+		events, bytes, wall_ns / 1e9, events * 1e9 / wall_ns, bytes * 1e3 / wall_ns, check & 0xFFFFFFFF);
+}
+
+void print_stats(void)
+{
+	struct serial_icounter_struct icount;
+	int i;
+
+	if (arguments.silent) return;
+
+	if (arguments.benchmark > 0)
+		print_benchmark();
+
+	if (arguments.flow_control != FLOW_NONE && tx_samples > 1)
+		printf("\nOutput held back by flow control about %lli ms", tx_blocked_ns / NSEC_PER_MSEC);
+	if (ioctl(serial, TIOCGICOUNT, &icount) == 0)
+		printf("\nSerial input overruns %i, buffer overruns %i, CTS changes %i",
+			icount.overrun, icount.buf_overrun, icount.cts);
+
+	if (arguments.framing == FRAMING_COBS) {
+		printf("\nFrames received %lu, dropped %lu (bad CRC %lu, bad COBS %lu, too long %lu)",
+			rx_frames_ok + rx_frames_dropped, rx_frames_dropped,
+			rx_frames_bad_crc, rx_frames_bad_cobs, rx_frames_too_long);
+	}
+
+	if (serial_is_udp) {
+		printf("\nDatagrams sent %lu, resent %lu, received %lu (%lu out of order or resent), lost %lu, duplicate or too late %lu, bad %lu",
+			udp_sent, udp_resent, udp_received, udp_recovered, udp_lost, udp_duplicates, udp_bad);
+	}
+
+	if (arguments.gap_count > 0)
+		printf("\nSysex gaps kept %lu", tx_gaps);
+
+	if (arguments.txqueue > 0)
+		printf("\nTransmit queue high water: real time %u, notes %u, controllers %u, channel %u, sysex %u bytes",
+			tx_queue[TX_REALTIME].high_water, tx_queue[TX_NOTE].high_water, tx_queue[TX_CONTROL].high_water,
+			tx_queue[TX_CHANNEL].high_water, tx_queue[TX_BULK].high_water);
+
+	if (arguments.coalesce) {
+		printf("\nCoalesced values dropped: serial -> alsa %lu, alsa -> serial %lu",
+			rx_coalesce.merged, tx_coalesce.merged);
+	}
+
+	for (i = 0; i < arguments.rate_count; i++)
+		printf("\nRate %-16s values thinned: serial -> alsa %lu, alsa -> serial %lu",
+			arguments.rate[i].text, rx_rate.thinned[i], tx_rate.thinned[i]);
+
+	for (i = 0; i < pool_classes; i++)
+		printf("\nSysex pool %5i bytes: %3i buffers, high water %3i", pool[i].size, pool[i].count, pool[i].high_water);
+	if (pool_misses > 0)
+		printf("\nSysex pool misses %lu", pool_misses);
+}
+
+void pin_thread(pthread_t thread, int cpu)
+{
+	cpu_set_t cpus;
+	int err;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	if ((err = pthread_setaffinity_np(thread, sizeof(cpus), &cpus)) != 0)
+		printf("Could not pin a thread to CPU %i: %s\n", cpu, strerror(err));
+}
+
 int main(int argc, char** argv)  // *new* int to remove compilation warning
 {
 	//arguments arguments;
 	struct termios oldtio, newtio;
 	struct serial_struct ser_info;
 	char* modem_device = "/dev/ttyS0";
-	snd_seq_t *seq;
+	snd_seq_t *seq = NULL;
 
 	arg_set_defaults(&arguments);
 	argp_parse(&argp, argc, argv, 0, 0, &arguments);
+	if (arguments.benchmark == BENCH_DECODE) {
+		bench_decode();
+		exit(0);
+	}
+	select_status_scanner();
+	open_pool();
+	open_rate_limits();
 
 	/*
-	 * Open MIDI output port
+	 * Open MIDI output port, or the rawmidi device
 	 */
 
-	port_out_id = open_seq(&seq);
+	if ((arguments.rawmidi[0] != '\0' || arguments.passthrough) &&
+	    (arguments.cables > 1 || arguments.latency > 0 || arguments.coalesce || arguments.rate_count > 0)) {
+		fprintf(stderr, "--rawmidi and --passthrough forward messages as they are, --cables, --latency, --coalesce and --rate do not apply.\n");
+		exit(1);
+	}
+
+	if (arguments.rawmidi[0] != '\0') {
+		open_rawmidi();
+	} else {
+		open_seq(&seq);
+		open_queue(seq);
+		if (arguments.passthrough)
+			open_passthrough();
+	}
 
 	/*
 	 *  Open modem device for reading and not as controlling tty because we don't
 	 *  want to get killed if linenoise sends CTRL-C.
 	 */
 
-	serial = open(arguments.serialdevice, O_RDWR | O_NOCTTY );
+	if ((serial = open_socket_link(arguments.serialdevice)) >= 0) {
+		signal(SIGPIPE, SIG_IGN);  // writes after the peer closed fail with EPIPE instead
+		arguments.txqueue = 0;      // there is no baud rate to pace the output at
+		arguments.backlog = 0;
+	} else {
+		serial = open(arguments.serialdevice, O_RDWR | O_NOCTTY );
+	}
 
 	if (serial < 0)
 	{
@@ -659,7 +3663,8 @@ int main(int argc, char** argv)  // *new* int to remove compilation warning
 	}
 
 	/* save current serial port settings */
-	tcgetattr(serial, &oldtio);
+	if (!serial_is_socket)
+		tcgetattr(serial, &oldtio);
 
 	/* clear struct for new port settings */
 	bzero(&newtio, sizeof(newtio));
@@ -667,12 +3672,14 @@ int main(int argc, char** argv)  // *new* int to remove compilation warning
 	/*
 	 * BAUDRATE : Set bps rate. You could also use cfsetispeed and cfsetospeed.
 	 * CRTSCTS  : output hardware flow control (only used if the cable has
-	 * all necessary lines. See sect. 7 of Serial-HOWTO)
+	 * all necessary lines. See sect. 7 of Serial-HOWTO), with --flow-control rtscts
 	 * CS8      : 8n1 (8bit, no parity, 1 stopbit)
 	 * CLOCAL   : local connection, no modem contol
 	 * CREAD    : enable receiving characters
 	 */
-	newtio.c_cflag = arguments.baudrate | CS8 | CLOCAL | CREAD; // CRTSCTS removed
+	newtio.c_cflag = arguments.baudrate | CS8 | CLOCAL | CREAD;
+	if (arguments.flow_control == FLOW_RTSCTS)
+		newtio.c_cflag |= CRTSCTS;
 
 	/*
 	 * IGNPAR  : ignore bytes with parity errors
@@ -682,6 +3689,16 @@ int main(int argc, char** argv)  // *new* int to remove compilation warning
 	 */
 	newtio.c_iflag = IGNPAR;
 
+	/*
+	 * IXON    : stop output while the device sends XOFF, with --flow-control xonxoff
+	 * IXOFF   : send XOFF to the device while our input buffer is full
+	 */
+	if (arguments.flow_control == FLOW_XONXOFF) {
+		newtio.c_iflag |= IXON | IXOFF;
+		newtio.c_cc[VSTART] = 0x11;
+		newtio.c_cc[VSTOP]  = 0x13;
+	}
+
 	/* Raw output */
 	newtio.c_oflag = 0;
 
@@ -692,16 +3709,26 @@ int main(int argc, char** argv)  // *new* int to remove compilation warning
 	newtio.c_lflag = 0; // non-canonical
 
 	/*
-	 * set up: we'll be reading 4 bytes at a time.
+	 * set up: how reads wait for bytes, see --read and serial_read()
 	 */
-	newtio.c_cc[VTIME]    = 0;  /* inter-character timer unused */
-	newtio.c_cc[VMIN]     = 1;  /* blocking read until n character arrives */
+	if (arguments.read_mode == READ_BATCH) {
+		newtio.c_cc[VTIME] = arguments.read_vtime;  /* inter-character timer, tenths of a second */
+		newtio.c_cc[VMIN]  = arguments.read_vmin;   /* blocking read until n characters arrive */
+	} else if (arguments.read_mode == READ_POLL || arguments.read_mode == READ_SPIN) {
+		newtio.c_cc[VTIME] = 0;  /* reads return what is there, poll() or spinning does the waiting */
+		newtio.c_cc[VMIN]  = 0;
+	} else {
+		newtio.c_cc[VTIME] = 0;  /* inter-character timer unused */
+		newtio.c_cc[VMIN]  = 1;  /* blocking read until 1 character arrives */
+	}
 
 	/*
 	 * now clean the modem line and activate the settings for the port
 	 */
-	tcflush(serial, TCIFLUSH);
-	tcsetattr(serial, TCSANOW, &newtio);
+	if (!serial_is_socket) {
+		tcflush(serial, TCIFLUSH);
+		tcsetattr(serial, TCSANOW, &newtio);
+	}
 
 	// Linux-specific: enable low latency mode (FTDI "nagling off")
 //	ioctl(serial, TIOCGSERIAL, &ser_info);
@@ -721,23 +3748,33 @@ int main(int argc, char** argv)  // *new* int to remove compilation warning
 	pthread_t midi_out_thread, midi_in_thread;
 	int iret1, iret2;
 	run = TRUE;
+	bench_start_ns = bench_next_ns = monotonic_ns();
 	iret1 = pthread_create(&midi_out_thread, NULL, read_midi_from_alsa, (void*) seq);
 	/* And also thread for polling serial data. As serial is currently read in
 		blocking mode, by this we can enable ctrl+c quiting and avoid zombie
 		alsa ports when killing app with ctrl+z */
 	iret2 = pthread_create(&midi_in_thread, NULL, read_midi_from_serial_port, (void*) seq);
+	if (arguments.cpu_serial >= 0)
+		pin_thread(midi_in_thread, arguments.cpu_serial);
+	if (arguments.cpu_alsa >= 0)
+		pin_thread(midi_out_thread, arguments.cpu_alsa);
 	signal(SIGINT, exit_cli);
 	signal(SIGTERM, exit_cli);
 
 	while (run)
 	{
-		sleep(100);
+		sleep(1);  // the serial reader stops the bridge when a connected socket closes
+		if (arguments.benchmark > 0 && monotonic_ns() - bench_start_ns >= arguments.benchmark * NSEC_PER_SEC)
+			run = FALSE;
 	}
 
 	void* status;
 	pthread_join(midi_out_thread, &status);
 
+	print_stats();
+
 	/* restore the old port settings */
-	tcsetattr(serial, TCSANOW, &oldtio);
+	if (!serial_is_socket)
+		tcsetattr(serial, TCSANOW, &oldtio);
 	printf("\ndone!\n");
 }